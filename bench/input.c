@@ -0,0 +1,305 @@
+/*
+ * Benchmark of the input backends: how long it takes from key events being
+ * written to the keysyms being looked up in the xkb state.
+ *
+ * usage: bench-input [--uinput] [max ns per event]
+ *
+ * The evdev reader is run against a pipe standing in for an event node. With
+ * --uinput, evdev and libinput are also compared on a virtual keyboard, if
+ * /dev/uinput can be opened. That keyboard types into whatever has focus, so
+ * it is never done unless asked for. With a limit, exits with status 1 if the
+ * pipe run is slower than that.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libinput.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <xkbcommon/xkbcommon.h>
+#include "evdev.h"
+
+#define BENCH_KEYS 200000
+/* Key events written at once; uinput clients only buffer a few dozen */
+#define BENCH_CHUNK 8
+
+struct bench_state {
+	struct xkb_state *xkb_state;
+	size_t keys;
+	xkb_keysym_t last_sym;
+};
+
+static const uint16_t keycodes[] = {
+	KEY_T, KEY_H, KEY_E, KEY_SPACE, KEY_Q, KEY_U, KEY_I, KEY_C, KEY_K,
+	KEY_B, KEY_R, KEY_O, KEY_W, KEY_N, KEY_F, KEY_X, KEY_DOT, KEY_ENTER,
+};
+#define NKEYCODES (sizeof(keycodes) / sizeof(keycodes[0]))
+
+static uint64_t now_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* What main.c does with each key before it gets to the keys ring */
+static void feed_key(struct bench_state *state, uint32_t keycode,
+		bool pressed) {
+	keycode += 8;
+	xkb_state_update_key(state->xkb_state, keycode,
+			pressed ? XKB_KEY_DOWN : XKB_KEY_UP);
+	state->last_sym = xkb_state_key_get_one_sym(state->xkb_state, keycode);
+	++state->keys;
+}
+
+static void evdev_key(void *data, uint32_t keycode, bool pressed,
+		uint64_t time) {
+	feed_key(data, keycode, pressed);
+}
+
+/* Fills events with n key events, each followed by a SYN_REPORT */
+static size_t fill_chunk(struct input_event *events, size_t n, size_t seq) {
+	size_t len = 0;
+	for (size_t i = 0; i < n; ++i, ++seq) {
+		events[len++] = (struct input_event){
+			.type = EV_KEY,
+			.code = keycodes[seq / 2 % NKEYCODES],
+			.value = seq % 2 == 0,
+		};
+		events[len++] = (struct input_event){
+			.type = EV_SYN,
+			.code = SYN_REPORT,
+		};
+	}
+	return len;
+}
+
+static bool write_chunk(int fd, size_t seq) {
+	struct input_event events[BENCH_CHUNK * 2];
+	size_t len = fill_chunk(events, BENCH_CHUNK, seq) * sizeof(events[0]);
+	return write(fd, events, len) == (ssize_t)len;
+}
+
+static void report(const char *name, uint64_t elapsed, size_t keys) {
+	printf("%-10s %10zu %10.0f %12.0f\n", name, keys,
+			(double)elapsed / keys, keys * 1e9 / elapsed);
+}
+
+/* The pipe stand-in: several chunks are queued before each dispatch */
+static double bench_pipe(struct bench_state *state) {
+	int fds[2];
+	struct wsk_evdev evdev;
+	if (pipe(fds) != 0 || !evdev_init(&evdev, evdev_key, state)
+			|| !evdev_add_fd(&evdev, fds[0], NULL)) {
+		fprintf(stderr, "Unable to set up the pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	state->keys = 0;
+	uint64_t start = now_nsec();
+	for (size_t seq = 0; seq < BENCH_KEYS; seq += BENCH_CHUNK * 16) {
+		for (size_t i = 0; i < 16; ++i) {
+			write_chunk(fds[1], seq + i * BENCH_CHUNK);
+		}
+		evdev_dispatch(&evdev);
+	}
+	uint64_t elapsed = now_nsec() - start;
+	report("pipe", elapsed, state->keys);
+
+	evdev_finish(&evdev);
+	close(fds[1]);
+	return (double)elapsed / state->keys;
+}
+
+static int open_restricted(const char *path, int flags, void *data) {
+	int fd = open(path, flags | O_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+static void close_restricted(int fd, void *data) {
+	close(fd);
+}
+
+static const struct libinput_interface libinput_impl = {
+	.open_restricted = open_restricted,
+	.close_restricted = close_restricted,
+};
+
+static void drain_libinput(struct bench_state *state,
+		struct libinput *libinput) {
+	libinput_dispatch(libinput);
+	struct libinput_event *event;
+	while ((event = libinput_get_event(libinput))) {
+		if (libinput_event_get_type(event) == LIBINPUT_EVENT_KEYBOARD_KEY) {
+			struct libinput_event_keyboard *kbevent =
+				libinput_event_get_keyboard_event(event);
+			feed_key(state, libinput_event_keyboard_get_key(kbevent),
+					libinput_event_keyboard_get_key_state(kbevent)
+						== LIBINPUT_KEY_STATE_PRESSED);
+		}
+		libinput_event_destroy(event);
+	}
+}
+
+/* Waits for everything written so far to arrive, or gives up after 1s */
+static void wait_keys(struct bench_state *state, size_t keys, int fd,
+		struct wsk_evdev *evdev, struct libinput *libinput) {
+	struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+	while (state->keys < keys && poll(&pollfd, 1, 1000) > 0) {
+		if (evdev) {
+			evdev_dispatch(evdev);
+		} else {
+			drain_libinput(state, libinput);
+		}
+	}
+}
+
+static void bench_uinput_run(struct bench_state *state, const char *name,
+		int uinput, int fd, struct wsk_evdev *evdev,
+		struct libinput *libinput) {
+	state->keys = 0;
+	uint64_t start = now_nsec();
+	for (size_t seq = 0; seq < BENCH_KEYS; seq += BENCH_CHUNK) {
+		if (!write_chunk(uinput, seq)) {
+			fprintf(stderr, "uinput write: %s\n", strerror(errno));
+			return;
+		}
+		wait_keys(state, seq + BENCH_CHUNK, fd, evdev, libinput);
+	}
+	report(name, now_nsec() - start, state->keys);
+}
+
+/* Finds /dev/input/eventN for the uinput device and waits for udev */
+static bool uinput_devnode(int uinput, char *path, size_t len) {
+	char sysname[64], syspath[128];
+	if (ioctl(uinput, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+		return false;
+	}
+	snprintf(syspath, sizeof(syspath),
+			"/sys/devices/virtual/input/%s", sysname);
+	DIR *dir = opendir(syspath);
+	if (!dir) {
+		return false;
+	}
+	bool found = false;
+	struct dirent *entry;
+	while (!found && (entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "event", 5) == 0) {
+			snprintf(path, len, "/dev/input/%s", entry->d_name);
+			found = true;
+		}
+	}
+	closedir(dir);
+	struct timespec delay = { .tv_nsec = 10000000 };
+	for (int i = 0; found && i < 100 && access(path, R_OK) != 0; ++i) {
+		nanosleep(&delay, NULL);
+	}
+	return found && access(path, R_OK) == 0;
+}
+
+static void bench_uinput(struct bench_state *state) {
+	int uinput = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (uinput < 0) {
+		printf("%-10s skipped: /dev/uinput: %s\n", "uinput", strerror(errno));
+		return;
+	}
+	struct uinput_setup setup = {
+		.id = { .bustype = BUS_VIRTUAL, .vendor = 1, .product = 1 },
+		.name = "wshowkeys benchmark keyboard",
+	};
+	ioctl(uinput, UI_SET_EVBIT, EV_KEY);
+	for (size_t i = 0; i < NKEYCODES; ++i) {
+		ioctl(uinput, UI_SET_KEYBIT, keycodes[i]);
+	}
+	// libinput wants a few letter keys before it calls it a keyboard
+	for (int key = KEY_ESC; key <= KEY_D; ++key) {
+		ioctl(uinput, UI_SET_KEYBIT, key);
+	}
+	char path[64];
+	if (ioctl(uinput, UI_DEV_SETUP, &setup) < 0
+			|| ioctl(uinput, UI_DEV_CREATE) < 0) {
+		printf("%-10s skipped: %s\n", "uinput", strerror(errno));
+		close(uinput);
+		return;
+	}
+	if (!uinput_devnode(uinput, path, sizeof(path))) {
+		printf("%-10s skipped: no event node\n", "uinput");
+		goto destroy;
+	}
+
+	struct wsk_evdev evdev;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && evdev_init(&evdev, evdev_key, state)
+			&& evdev_add_fd(&evdev, fd, path)) {
+		bench_uinput_run(state, "evdev", uinput,
+				evdev_get_fd(&evdev), &evdev, NULL);
+		evdev_finish(&evdev);
+	} else {
+		printf("%-10s skipped: %s: %s\n", "evdev", path, strerror(errno));
+	}
+
+	struct libinput *libinput =
+		libinput_path_create_context(&libinput_impl, NULL);
+	if (libinput && libinput_path_add_device(libinput, path)) {
+		drain_libinput(state, libinput);
+		bench_uinput_run(state, "libinput", uinput,
+				libinput_get_fd(libinput), NULL, libinput);
+	} else {
+		printf("%-10s skipped: %s is not a keyboard to libinput\n",
+				"libinput", path);
+	}
+	libinput_unref(libinput);
+
+destroy:
+	ioctl(uinput, UI_DEV_DESTROY);
+	close(uinput);
+}
+
+int main(int argc, char *argv[]) {
+	bool uinput = false;
+	double max_ns = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--uinput") == 0) {
+			uinput = true;
+		} else {
+			max_ns = strtod(argv[i], NULL);
+		}
+	}
+
+	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_rule_names names = { 0 };
+	struct xkb_keymap *keymap = context ? xkb_keymap_new_from_names(
+			context, &names, XKB_KEYMAP_COMPILE_NO_FLAGS) : NULL;
+	if (!keymap) {
+		fprintf(stderr, "Unable to compile the default keymap\n");
+		return 1;
+	}
+	struct bench_state state = { .xkb_state = xkb_state_new(keymap) };
+
+	printf("%-10s %10s %10s %12s\n", "input", "keys", "ns/key", "keys/s");
+	double ns_key = bench_pipe(&state);
+	if (uinput) {
+		bench_uinput(&state);
+	}
+
+	xkb_state_unref(state.xkb_state);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(context);
+
+	if (ns_key < 0) {
+		return 1;
+	} else if (max_ns > 0 && ns_key > max_ns) {
+		fprintf(stderr, "pipe: %.0f ns/key is over the limit of %.0f\n",
+				ns_key, max_ns);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Offline benchmark of the key drawing path: runs render_plan and render_draw
+ * against in-memory image surfaces, with no compositor or input devices.
+ *
+ * usage: bench-render [max ns per key]
+ *
+ * With an argument above 0, exits with status 1 if any run is slower than
+ * that. Allocations are only counted on glibc.
+ */
+#include <cairo/cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xkbcommon/xkbcommon.h>
+#include "keysym.h"
+#include "pango.h"
+#include "render.h"
+#include "shm.h"
+
+#define BENCH_KEYS 20000
+#define BENCH_INTERVAL 20000 // usec between keypresses
+#define BENCH_REPEAT_DELAY 600 // msec, a common compositor default
+
+static size_t allocs;
+
+/*
+ * Allocations are counted by interposing on the allocator, which needs the
+ * entry points glibc has for that. They are not counted elsewhere.
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+	++allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	++allocs;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	++allocs;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+struct bench_scenario {
+	const char *name;
+	const xkb_keysym_t *syms;
+	size_t nsyms;
+};
+
+static const xkb_keysym_t words[] = {
+	XKB_KEY_t, XKB_KEY_h, XKB_KEY_e, XKB_KEY_space,
+	XKB_KEY_q, XKB_KEY_u, XKB_KEY_i, XKB_KEY_c, XKB_KEY_k, XKB_KEY_space,
+	XKB_KEY_b, XKB_KEY_r, XKB_KEY_o, XKB_KEY_w, XKB_KEY_n, XKB_KEY_space,
+	XKB_KEY_f, XKB_KEY_o, XKB_KEY_x, XKB_KEY_period, XKB_KEY_Return,
+};
+
+static const xkb_keysym_t burst[] = {
+	XKB_KEY_a, XKB_KEY_s, XKB_KEY_d, XKB_KEY_f, XKB_KEY_g, XKB_KEY_h,
+	XKB_KEY_j, XKB_KEY_k, XKB_KEY_l, XKB_KEY_semicolon, XKB_KEY_q,
+	XKB_KEY_w, XKB_KEY_e, XKB_KEY_r, XKB_KEY_t, XKB_KEY_y, XKB_KEY_u,
+	XKB_KEY_i, XKB_KEY_o, XKB_KEY_p, XKB_KEY_z, XKB_KEY_x, XKB_KEY_c,
+	XKB_KEY_v, XKB_KEY_b, XKB_KEY_n, XKB_KEY_m, XKB_KEY_1, XKB_KEY_2,
+	XKB_KEY_3, XKB_KEY_4, XKB_KEY_5, XKB_KEY_6, XKB_KEY_7, XKB_KEY_8,
+};
+
+static const xkb_keysym_t special[] = {
+	XKB_KEY_Control_L, XKB_KEY_c, XKB_KEY_Control_L, XKB_KEY_v,
+	XKB_KEY_BackSpace, XKB_KEY_BackSpace, XKB_KEY_BackSpace,
+	XKB_KEY_Left, XKB_KEY_Left, XKB_KEY_Up, XKB_KEY_Tab, XKB_KEY_Tab,
+	XKB_KEY_Escape, XKB_KEY_Shift_L, XKB_KEY_A, XKB_KEY_Return,
+	XKB_KEY_Super_L, XKB_KEY_Delete, XKB_KEY_F5,
+};
+
+/* In 120ths, as wp_fractional_scale_v1 gives them */
+static const int scales[] = { 120, 180, 240, 360 };
+
+static const struct bench_scenario scenarios[] = {
+	{ "words", words, sizeof(words) / sizeof(words[0]) },
+	{ "burst", burst, sizeof(burst) / sizeof(burst[0]) },
+	{ "special", special, sizeof(special) / sizeof(special[0]) },
+};
+
+struct bench_state {
+	struct wsk_render_config config;
+	struct wsk_label_cache labels;
+	struct wsk_renderer renderer;
+	struct wsk_keys keys;
+	/* Stand-ins for the shm pool, handed out in turn */
+	struct pool_buffer buffers[2];
+	size_t next_buffer;
+};
+
+static uint64_t now_nsec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void buffer_finish(struct pool_buffer *buffer) {
+	if (buffer->cairo) {
+		cairo_destroy(buffer->cairo);
+	}
+	if (buffer->surface) {
+		cairo_surface_destroy(buffer->surface);
+	}
+	memset(buffer, 0, sizeof(struct pool_buffer));
+}
+
+/* Like get_next_buffer, minus the Wayland side */
+static struct pool_buffer *next_buffer(struct bench_state *state,
+		uint32_t width, uint32_t height) {
+	struct pool_buffer *buffer = &state->buffers[state->next_buffer];
+	state->next_buffer = (state->next_buffer + 1) % 2;
+	buffer->fresh = false;
+	if (buffer->width == width && buffer->height == height) {
+		return buffer;
+	}
+	buffer_finish(buffer);
+	buffer->surface = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, width, height);
+	buffer->cairo = cairo_create(buffer->surface);
+	buffer->data = cairo_image_surface_get_data(buffer->surface);
+	buffer->width = width;
+	buffer->height = height;
+	buffer->fresh = true;
+	return buffer;
+}
+
+/*
+ * The same as a press in handle_key, for a keysym: presses of the same
+ * special key within the repeat delay of each other are counted as repeats
+ */
+static void press(struct bench_state *state, xkb_keysym_t sym, uint64_t time) {
+	struct wsk_keys *keys = &state->keys;
+	bool printable = sym > ' ' && sym < 0x7F;
+	struct wsk_keypress *key = keys->len ? keys_at(keys, keys->len - 1) : NULL;
+	if (key && key->sym == sym && key->label != KEYSYM_LABEL_CHAR
+			&& key->repeat < UINT16_MAX && time >= key->time
+			&& time - key->time < (uint64_t)BENCH_REPEAT_DELAY * 1000) {
+		++key->repeat;
+		key->time = time;
+		render_key_changed(&state->renderer, keys->seq + keys->len - 1);
+		return;
+	}
+	key = keys_append(keys);
+	key->sym = sym;
+	key->time = time;
+	key->repeat = 1;
+	key->label = printable ? KEYSYM_LABEL_CHAR : keysym_label_find(sym);
+}
+
+/* Draws a frame the way render_frame does, returns false if it was empty */
+static bool frame(struct bench_state *state, int scale, uint64_t time) {
+	struct wsk_frame frame = { .scale = scale, .time = time };
+	render_plan(&state->renderer, &state->keys, &frame);
+	uint32_t width = frame.width, height = frame.height;
+	if (width == 0 || height == 0) {
+		render_invalidate(&state->renderer);
+		return false;
+	}
+	struct pool_buffer *buffer = next_buffer(state, width, height);
+	render_draw(&state->renderer, &state->keys, &frame, buffer);
+	return true;
+}
+
+static void run(struct bench_state *state,
+		const struct bench_scenario *scenario, int scale, size_t nkeys) {
+	uint64_t time = 0;
+	for (size_t i = 0; i < nkeys; ++i) {
+		time += BENCH_INTERVAL;
+		press(state, scenario->syms[i % scenario->nsyms], time);
+		frame(state, scale, time);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	double max_ns = argc > 1 ? strtod(argv[1], NULL) : 0;
+	int ret = 0;
+
+	keysym_labels_init();
+
+	printf("%-8s %5s %10s %10s %12s\n",
+			"keys", "scale", "ns/key", "frames/s", "allocs/frame");
+	for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+		for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]); ++i) {
+			int scale = scales[i];
+			struct bench_state state = {
+				.config = {
+					.foreground = 0xFFFFFFFF,
+					.background = 0x000000CC,
+					.specialfg = 0xAAAAAAFF,
+					.font = "monospace 24",
+					.timeout = 1000000,
+					.animation = WSK_ANIMATION_NONE,
+				},
+			};
+			if (!keys_init(&state.keys, 32)) {
+				fprintf(stderr, "calloc failed\n");
+				return 1;
+			}
+			renderer_init(&state.renderer, &state.config, &state.labels);
+
+			// Warm up the label cache, as a running wshowkeys would have
+			run(&state, &scenarios[s], scale, scenarios[s].nsyms * 2);
+
+			size_t start_allocs = allocs;
+			uint64_t start = now_nsec();
+			run(&state, &scenarios[s], scale, BENCH_KEYS);
+			uint64_t elapsed = now_nsec() - start;
+			size_t frame_allocs = allocs - start_allocs;
+
+			double ns_key = (double)elapsed / BENCH_KEYS;
+			printf("%-8s %5.2f %10.0f %10.0f ", scenarios[s].name,
+					(double)scale / WSK_SCALE_BASE, ns_key, 1e9 / ns_key);
+			if (BENCH_COUNT_ALLOCS) {
+				printf("%12.2f\n", (double)frame_allocs / BENCH_KEYS);
+			} else {
+				printf("%12s\n", "-");
+			}
+			if (max_ns > 0 && ns_key > max_ns) {
+				fprintf(stderr, "%s at scale %.2f: %.0f ns/key is over "
+						"the limit of %.0f\n", scenarios[s].name,
+						(double)scale / WSK_SCALE_BASE,
+						ns_key, max_ns);
+				ret = 1;
+			}
+
+			buffer_finish(&state.buffers[0]);
+			buffer_finish(&state.buffers[1]);
+			renderer_finish(&state.renderer);
+			label_cache_finish(&state.labels);
+			keys_finish(&state.keys);
+		}
+	}
+	return ret;
+}
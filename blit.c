@@ -0,0 +1,161 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "blit.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BLIT_NEON
+#include <arm_neon.h>
+#endif
+
+/* x * y / 255, rounded, for 8-bit x and y */
+static inline uint32_t mul_255(uint32_t x, uint32_t y) {
+	uint32_t t = x * y + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+/* Each channel of pixel times a / 255 */
+static inline uint32_t scale_pixel(uint32_t pixel, uint32_t a) {
+	return mul_255(pixel >> 24, a) << 24
+		| mul_255(pixel >> 16 & 0xFF, a) << 16
+		| mul_255(pixel >> 8 & 0xFF, a) << 8
+		| mul_255(pixel & 0xFF, a);
+}
+
+static inline uint32_t over_pixel(uint32_t src, uint32_t dst, uint32_t alpha) {
+	if (alpha != 255) {
+		src = scale_pixel(src, alpha);
+	}
+	// Can't carry: each channel of src is at most its alpha
+	return src + scale_pixel(dst, 255 - (src >> 24));
+}
+
+uint32_t blit_premultiply(uint32_t rgba) {
+	uint32_t a = rgba & 0xFF;
+	return a << 24
+		| mul_255(rgba >> 24, a) << 16
+		| mul_255(rgba >> 16 & 0xFF, a) << 8
+		| mul_255(rgba >> 8 & 0xFF, a);
+}
+
+#if defined(__SSE2__)
+/* x * y / 255 on 16-bit lanes holding 8-bit values */
+static inline __m128i mul_255_epi16(__m128i x, __m128i y) {
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i scale_epu8(__m128i px, __m128i a_lo, __m128i a_hi) {
+	__m128i zero = _mm_setzero_si128();
+	return _mm_packus_epi16(
+			mul_255_epi16(_mm_unpacklo_epi8(px, zero), a_lo),
+			mul_255_epi16(_mm_unpackhi_epi8(px, zero), a_hi));
+}
+
+static void over_row(uint32_t *dst, const uint32_t *src,
+		uint32_t width, uint8_t alpha) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i m = _mm_set1_epi16(alpha);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+		if (alpha != 255) {
+			s = scale_epu8(s, m, m);
+		}
+		// 255 - alpha of each pixel, in all four of its bytes
+		__m128i a = _mm_srli_epi32(s, 24);
+		a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+		a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+		a = _mm_xor_si128(a, _mm_set1_epi8((char)0xFF));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+		d = scale_epu8(d, _mm_unpacklo_epi8(a, zero),
+				_mm_unpackhi_epi8(a, zero));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_adds_epu8(s, d));
+	}
+	for (; x < width; ++x) {
+		dst[x] = over_pixel(src[x], dst[x], alpha);
+	}
+}
+
+static void fill_row(uint32_t *dst, uint32_t width, uint32_t pixel) {
+	__m128i p = _mm_set1_epi32((int)pixel);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		_mm_storeu_si128((__m128i *)(dst + x), p);
+	}
+	for (; x < width; ++x) {
+		dst[x] = pixel;
+	}
+}
+#elif defined(BLIT_NEON)
+static inline uint8x8_t mul_255_u8(uint8x8_t x, uint8x8_t y) {
+	uint16x8_t t = vmull_u8(x, y);
+	return vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+}
+
+static void over_row(uint32_t *dst, const uint32_t *src,
+		uint32_t width, uint8_t alpha) {
+	uint8x8_t m = vdup_n_u8(alpha);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		// val[0..3] are blue, green, red and alpha
+		uint8x8x4_t s = vld4_u8((const uint8_t *)(src + x));
+		uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + x));
+		if (alpha != 255) {
+			for (int c = 0; c < 4; ++c) {
+				s.val[c] = mul_255_u8(s.val[c], m);
+			}
+		}
+		uint8x8_t ia = vmvn_u8(s.val[3]);
+		for (int c = 0; c < 4; ++c) {
+			d.val[c] = vqadd_u8(s.val[c], mul_255_u8(d.val[c], ia));
+		}
+		vst4_u8((uint8_t *)(dst + x), d);
+	}
+	for (; x < width; ++x) {
+		dst[x] = over_pixel(src[x], dst[x], alpha);
+	}
+}
+
+static void fill_row(uint32_t *dst, uint32_t width, uint32_t pixel) {
+	uint32x4_t p = vdupq_n_u32(pixel);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		vst1q_u32(dst + x, p);
+	}
+	for (; x < width; ++x) {
+		dst[x] = pixel;
+	}
+}
+#else
+static void over_row(uint32_t *dst, const uint32_t *src,
+		uint32_t width, uint8_t alpha) {
+	for (uint32_t x = 0; x < width; ++x) {
+		dst[x] = over_pixel(src[x], dst[x], alpha);
+	}
+}
+
+static void fill_row(uint32_t *dst, uint32_t width, uint32_t pixel) {
+	for (uint32_t x = 0; x < width; ++x) {
+		dst[x] = pixel;
+	}
+}
+#endif
+
+void blit_fill(uint32_t *dst, size_t stride,
+		uint32_t width, uint32_t height, uint32_t pixel) {
+	for (uint32_t y = 0; y < height; ++y) {
+		fill_row(dst + y * stride, width, pixel);
+	}
+}
+
+void blit_over(uint32_t *dst, size_t dst_stride,
+		const uint32_t *src, size_t src_stride,
+		uint32_t width, uint32_t height, uint8_t alpha) {
+	if (alpha == 0) {
+		return;
+	}
+	for (uint32_t y = 0; y < height; ++y) {
+		over_row(dst + y * dst_stride, src + y * src_stride, width, alpha);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef _WSK_BLIT_H
+#define _WSK_BLIT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pixel loops on premultiplied ARGB32, as cairo image surfaces and
+ * WL_SHM_FORMAT_ARGB8888 buffers hold them. Strides are in pixels.
+ */
+
+uint32_t blit_premultiply(uint32_t rgba);
+void blit_fill(uint32_t *dst, size_t stride,
+		uint32_t width, uint32_t height, uint32_t pixel);
+/* dst = src * alpha / 255 OVER dst */
+void blit_over(uint32_t *dst, size_t dst_stride,
+		const uint32_t *src, size_t src_stride,
+		uint32_t width, uint32_t height, uint8_t alpha);
+
+#endif
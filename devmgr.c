@@ -13,7 +13,9 @@
 #include <libudev.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -27,9 +29,20 @@ enum msg_type {
 	MSG_END,
 };
 
+/*
+ * Requests are a header followed by len bytes of path, without a NUL. Each is
+ * answered by a struct msg_reply with the same id and, if err is 0, an fd.
+ * Several requests may be in flight at once.
+ */
 struct msg {
-	enum msg_type msg_type;
-	char path[PATH_MAX];
+	uint16_t msg_type;
+	uint16_t len;
+	uint32_t id;
+};
+
+struct msg_reply {
+	uint32_t id;
+	int32_t err;
 };
 
 static ssize_t recv_msg(int sock, int *fd_out, void *buf, size_t buf_len) {
@@ -94,21 +107,31 @@ static void send_msg(int sock, int fd, void *buf, size_t buf_len) {
 }
 
 static void devmgr_run(int sockfd, const char *devpath) {
-	struct msg msg;
+	struct {
+		struct msg msg;
+		char path[PATH_MAX];
+	} buf;
 	int fdin = -1;
 	bool running = true;
 
-	while (running && recv_msg(sockfd, &fdin, &msg, sizeof(msg)) > 0) {
-		switch (msg.msg_type) {
+	ssize_t n;
+	while (running && (n = recv_msg(sockfd, &fdin, &buf, sizeof(buf))) > 0) {
+		if ((size_t)n < sizeof(buf.msg)
+				|| (size_t)n != sizeof(buf.msg) + buf.msg.len
+				|| buf.msg.len >= sizeof(buf.path)) {
+			exit(1);
+		}
+		buf.path[buf.msg.len] = '\0';
+		switch (buf.msg.msg_type) {
 		case MSG_OPEN:
 			errno = 0;
-			if (strstr(msg.path, devpath) != msg.path) {
+			if (strstr(buf.path, devpath) != buf.path) {
 				/* Hackerman detected */
 				exit(1);
 			}
-			int fd = open(msg.path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NONBLOCK);
-			int ret = errno;
-			send_msg(sockfd, ret ? -1 : fd, &ret, sizeof(ret));
+			int fd = open(buf.path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NONBLOCK);
+			struct msg_reply reply = { .id = buf.msg.id, .err = errno };
+			send_msg(sockfd, reply.err ? -1 : fd, &reply, sizeof(reply));
 			if (fd >= 0) {
 				close(fd);
 			}
@@ -117,13 +140,15 @@ static void devmgr_run(int sockfd, const char *devpath) {
 			running = false;
 			send_msg(sockfd, -1, NULL, 0);
 			break;
+		default:
+			exit(1);
 		}
 	}
 
 	exit(0);
 }
 
-int devmgr_start(int *fd, pid_t *pid, const char *devpath) {
+int devmgr_start(struct wsk_devmgr *devmgr, const char *devpath) {
 	if (geteuid() != 0) {
 		fprintf(stderr, "wshowkeys needs to be setuid to read input events\n");
 		return 1;
@@ -146,9 +171,18 @@ int devmgr_start(int *fd, pid_t *pid, const char *devpath) {
 		devmgr_run(sock[1], devpath); /* Does not return */
 	}
 	close(sock[1]);
-	*fd = sock[0];
-	*pid = child;
+	devmgr->sock = sock[0];
+	devmgr->pid = child;
 
+	return devmgr_drop_root();
+}
+
+/*
+ * Gives up the setuid and setgid bits for good. Called by devmgr_start once
+ * the helper is running, and by main on its own when no helper is needed, so
+ * that no user-supplied path is ever opened as root.
+ */
+int devmgr_drop_root(void) {
 	if (setgid(getgid()) != 0) {
 		fprintf(stderr, "devmgr: setgid: %s\n", strerror(errno));
 		return 1;
@@ -161,32 +195,130 @@ int devmgr_start(int *fd, pid_t *pid, const char *devpath) {
 		fprintf(stderr, "devmgr: failed to drop root\n");
 		return 1;
 	}
-
 	return 0;
 }
 
-int devmgr_open(int sockfd, const char *path) {
-	struct msg msg = { .msg_type = MSG_OPEN };
-	snprintf(msg.path, sizeof(msg.path), "%s", path);
+static void send_request(struct wsk_devmgr *devmgr,
+		enum msg_type msg_type, uint32_t id, const char *path) {
+	struct {
+		struct msg msg;
+		char path[PATH_MAX];
+	} buf = { .msg = { .msg_type = msg_type, .id = id } };
+	size_t len = path ? strlen(path) : 0;
+	if (len >= sizeof(buf.path)) {
+		len = sizeof(buf.path) - 1;
+	}
+	if (len) {
+		memcpy(buf.path, path, len);
+	}
+	buf.msg.len = len;
+	send_msg(devmgr->sock, -1, &buf, sizeof(buf.msg) + len);
+}
 
-	send_msg(sockfd, -1, &msg, sizeof(msg));
+static struct wsk_devmgr_request *find_request(struct wsk_devmgr *devmgr,
+		const char *path) {
+	for (struct wsk_devmgr_request *request = devmgr->requests;
+			request; request = request->next) {
+		if (strcmp(request->path, path) == 0) {
+			return request;
+		}
+	}
+	return NULL;
+}
 
-	int fd, err, ret;
+/* Reads one reply and files it with its request; false if the helper died */
+static bool receive_reply(struct wsk_devmgr *devmgr) {
+	struct msg_reply reply;
+	int fd;
 	int retry = 0;
+	ssize_t ret;
 	do {
-		ret = recv_msg(sockfd, &fd, &err, sizeof(err));
+		ret = recv_msg(devmgr->sock, &fd, &reply, sizeof(reply));
 	} while (ret == 0 && retry++ < 3);
+	if (ret != sizeof(reply)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
 
-	return err ? -err : fd;
+	for (struct wsk_devmgr_request *request = devmgr->requests;
+			request; request = request->next) {
+		if (request->id == reply.id && !request->done) {
+			request->done = true;
+			request->fd = reply.err ? -reply.err : fd;
+			--devmgr->in_flight;
+			return true;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return true;
+}
+
+void devmgr_prefetch(struct wsk_devmgr *devmgr, const char *path) {
+	if (find_request(devmgr, path)) {
+		return;
+	}
+	// Don't let the replies fill up the socket while nobody reads them
+	while (devmgr->in_flight >= WSK_DEVMGR_MAX_IN_FLIGHT) {
+		if (!receive_reply(devmgr)) {
+			return;
+		}
+	}
+	struct wsk_devmgr_request *request =
+		calloc(1, sizeof(struct wsk_devmgr_request) + strlen(path) + 1);
+	if (!request) {
+		return;
+	}
+	request->id = ++devmgr->next_id;
+	strcpy(request->path, path);
+	request->next = devmgr->requests;
+	devmgr->requests = request;
+	++devmgr->in_flight;
+	send_request(devmgr, MSG_OPEN, request->id, path);
 }
 
-void devmgr_finish(int sock, pid_t pid) {
-	struct msg msg = { .msg_type = MSG_END };
+int devmgr_open(struct wsk_devmgr *devmgr, const char *path) {
+	devmgr_prefetch(devmgr, path);
+	struct wsk_devmgr_request *request = find_request(devmgr, path);
+	if (!request) {
+		return -ENOMEM;
+	}
+	while (!request->done) {
+		if (!receive_reply(devmgr)) {
+			request->done = true;
+			request->fd = -EPIPE;
+			--devmgr->in_flight;
+		}
+	}
+
+	struct wsk_devmgr_request **link = &devmgr->requests;
+	while (*link != request) {
+		link = &(*link)->next;
+	}
+	*link = request->next;
+	int fd = request->fd;
+	free(request);
+	return fd;
+}
+
+void devmgr_discard(struct wsk_devmgr *devmgr) {
+	while (devmgr->requests) {
+		int fd = devmgr_open(devmgr, devmgr->requests->path);
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
 
-	send_msg(sock, -1, &msg, sizeof(msg));
-	recv_msg(sock, NULL, NULL, 0);
+void devmgr_finish(struct wsk_devmgr *devmgr) {
+	devmgr_discard(devmgr);
+	send_request(devmgr, MSG_END, 0, NULL);
+	recv_msg(devmgr->sock, NULL, NULL, 0);
 
-	waitpid(pid, NULL, 0);
+	waitpid(devmgr->pid, NULL, 0);
 
-	close(sock);
+	close(devmgr->sock);
 }
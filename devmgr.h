@@ -1,8 +1,38 @@
 #ifndef _DEVMGR_H
 #define _DEVMGR_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-int devmgr_start(int *fd, pid_t *pid, const char *devpath);
-int devmgr_open(int sockfd, const char *path);
-void devmgr_finish(int sock, pid_t pid);
+/* Opens requested beyond this wait for the oldest replies to be read */
+#define WSK_DEVMGR_MAX_IN_FLIGHT 64
+
+struct wsk_devmgr_request {
+	uint32_t id;
+	bool done;
+	int fd; // Or -errno, once done
+	struct wsk_devmgr_request *next;
+	char path[];
+};
+
+/*
+ * The unprivileged end of the socket to the root helper. Opens can be
+ * requested ahead of time with devmgr_prefetch, so that the helper works
+ * through a whole batch of devices while their fds are collected one by one.
+ */
+struct wsk_devmgr {
+	int sock;
+	pid_t pid;
+	uint32_t next_id;
+	size_t in_flight;
+	struct wsk_devmgr_request *requests;
+};
+
+int devmgr_start(struct wsk_devmgr *devmgr, const char *devpath);
+int devmgr_drop_root(void);
+void devmgr_prefetch(struct wsk_devmgr *devmgr, const char *path);
+int devmgr_open(struct wsk_devmgr *devmgr, const char *path);
+void devmgr_discard(struct wsk_devmgr *devmgr);
+void devmgr_finish(struct wsk_devmgr *devmgr);
 
 #endif
@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libudev.h>
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "devmgr.h"
+#include "evdev.h"
+
+_Static_assert(sizeof(struct input_event)
+		<= sizeof(((struct wsk_evdev_device *)0)->partial),
+		"partial is too small for struct input_event");
+
+bool evdev_init(struct wsk_evdev *evdev, wsk_evdev_key_func key, void *data) {
+	memset(evdev, 0, sizeof(struct wsk_evdev));
+	evdev->key = key;
+	evdev->data = data;
+	evdev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (evdev->epoll_fd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Takes ownership of fd, which may also be a pipe of struct input_event */
+bool evdev_add_fd(struct wsk_evdev *evdev, int fd, const char *devnode) {
+	struct wsk_evdev_device *device =
+		calloc(1, sizeof(struct wsk_evdev_device));
+	if (!device) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	device->fd = fd;
+	device->devnode = devnode ? strdup(devnode) : NULL;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (devnode) {
+		// Timestamps are CLOCK_REALTIME otherwise
+		int clock = CLOCK_MONOTONIC;
+		ioctl(fd, EVIOCSCLOCKID, &clock);
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = device };
+	if (epoll_ctl(evdev->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		free(device->devnode);
+		free(device);
+		close(fd);
+		return false;
+	}
+	device->next = evdev->devices;
+	evdev->devices = device;
+	return true;
+}
+
+static void remove_device(struct wsk_evdev *evdev,
+		struct wsk_evdev_device *device) {
+	struct wsk_evdev_device **link = &evdev->devices;
+	while (*link != device) {
+		link = &(*link)->next;
+	}
+	*link = device->next;
+	epoll_ctl(evdev->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	close(device->fd);
+	free(device->devnode);
+	free(device);
+}
+
+/* Whether udev_device is a keyboard on our seat which isn't open yet */
+static bool wants_device(struct wsk_evdev *evdev,
+		struct udev_device *udev_device) {
+	const char *devnode = udev_device_get_devnode(udev_device);
+	const char *sysname = udev_device_get_sysname(udev_device);
+	if (!devnode || !sysname || strncmp(sysname, "event", 5) != 0) {
+		return false;
+	}
+	const char *key = udev_device_get_property_value(udev_device,
+			"ID_INPUT_KEY");
+	if (!key || strcmp(key, "1") != 0) {
+		return false;
+	}
+	const char *seat = udev_device_get_property_value(udev_device, "ID_SEAT");
+	if (strcmp(seat ? seat : "seat0", evdev->seat) != 0) {
+		return false;
+	}
+	for (struct wsk_evdev_device *device = evdev->devices;
+			device; device = device->next) {
+		if (device->devnode && strcmp(device->devnode, devnode) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void prefetch_device(struct wsk_evdev *evdev,
+		struct udev_device *udev_device) {
+	if (wants_device(evdev, udev_device)) {
+		devmgr_prefetch(evdev->devmgr,
+				udev_device_get_devnode(udev_device));
+	}
+}
+
+static void open_device(struct wsk_evdev *evdev,
+		struct udev_device *udev_device) {
+	if (!wants_device(evdev, udev_device)) {
+		return;
+	}
+	const char *devnode = udev_device_get_devnode(udev_device);
+	int fd = devmgr_open(evdev->devmgr, devnode);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", devnode, strerror(-fd));
+		return;
+	}
+	evdev_add_fd(evdev, fd, devnode);
+}
+
+/* Opens the keyboards on seat now and as they are plugged in */
+bool evdev_assign_seat(struct wsk_evdev *evdev,
+		struct udev *udev, struct wsk_devmgr *devmgr, const char *seat) {
+	evdev->udev = udev_ref(udev);
+	evdev->devmgr = devmgr;
+	evdev->seat = strdup(seat);
+
+	evdev->monitor = udev_monitor_new_from_netlink(udev, "udev");
+	if (!evdev->monitor || udev_monitor_filter_add_match_subsystem_devtype(
+				evdev->monitor, "input", NULL) < 0
+			|| udev_monitor_enable_receiving(evdev->monitor) < 0) {
+		fprintf(stderr, "Unable to monitor input devices\n");
+		return false;
+	}
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(evdev->epoll_fd, EPOLL_CTL_ADD,
+				udev_monitor_get_fd(evdev->monitor), &event) != 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		fprintf(stderr, "udev_enumerate_new: %s\n", strerror(errno));
+		return false;
+	}
+	udev_enumerate_add_match_subsystem(enumerate, "input");
+	udev_enumerate_add_match_property(enumerate, "ID_INPUT_KEY", "1");
+	udev_enumerate_scan_devices(enumerate);
+	// Ask for all of the keyboards before waiting for any of them
+	for (int pass = 0; pass < 2; ++pass) {
+		struct udev_list_entry *entry;
+		udev_list_entry_foreach(entry,
+				udev_enumerate_get_list_entry(enumerate)) {
+			struct udev_device *udev_device = udev_device_new_from_syspath(
+					udev, udev_list_entry_get_name(entry));
+			if (!udev_device) {
+				continue;
+			}
+			if (pass == 0) {
+				prefetch_device(evdev, udev_device);
+			} else {
+				open_device(evdev, udev_device);
+			}
+			udev_device_unref(udev_device);
+		}
+	}
+	udev_enumerate_unref(enumerate);
+	return true;
+}
+
+int evdev_get_fd(struct wsk_evdev *evdev) {
+	return evdev->epoll_fd;
+}
+
+/*
+ * A keyboard usually comes with several event nodes at once; all of those
+ * which are queued up are requested before any is waited for.
+ */
+static void handle_monitor(struct wsk_evdev *evdev) {
+	struct udev_device *added[16];
+	size_t nadded = 0;
+	struct udev_device *udev_device;
+	while (nadded < sizeof(added) / sizeof(added[0]) && (udev_device =
+				udev_monitor_receive_device(evdev->monitor))) {
+		const char *action = udev_device_get_action(udev_device);
+		const char *devnode = udev_device_get_devnode(udev_device);
+		if (action && strcmp(action, "add") == 0) {
+			prefetch_device(evdev, udev_device);
+			added[nadded++] = udev_device;
+			continue;
+		} else if (action && devnode && strcmp(action, "remove") == 0) {
+			struct wsk_evdev_device *device = evdev->devices;
+			for (; device; device = device->next) {
+				if (device->devnode
+						&& strcmp(device->devnode, devnode) == 0) {
+					remove_device(evdev, device);
+					break;
+				}
+			}
+		}
+		udev_device_unref(udev_device);
+	}
+	for (size_t i = 0; i < nadded; ++i) {
+		open_device(evdev, added[i]);
+		udev_device_unref(added[i]);
+	}
+}
+
+static uint64_t event_time(const struct input_event *event) {
+	return (uint64_t)event->input_event_sec * 1000000
+		+ event->input_event_usec;
+}
+
+/* Passes a key on, unless it is a button */
+static void report_key(struct wsk_evdev *evdev,
+		struct wsk_evdev_device *device,
+		uint32_t code, bool pressed, uint64_t time) {
+	if (code >= KEY_CNT || (code >= BTN_MISC && code < KEY_OK)) {
+		return;
+	}
+	uint8_t bit = 1 << (code % 8);
+	if (pressed) {
+		device->down[code / 8] |= bit;
+	} else {
+		device->down[code / 8] &= ~bit;
+	}
+	evdev->key(evdev->data, code, pressed, time);
+}
+
+/*
+ * Reports the presses and releases lost to a SYN_DROPPED, by comparing the
+ * keys reported as down with the kernel's key state. Pipes have no key state,
+ * so on those all keys are let go.
+ */
+static void resync_keys(struct wsk_evdev *evdev,
+		struct wsk_evdev_device *device, uint64_t time) {
+	uint8_t down[sizeof(device->down)] = {0};
+	if (device->devnode) {
+		ioctl(device->fd, EVIOCGKEY(sizeof(down)), down);
+	}
+	for (uint32_t code = 0; code < KEY_CNT; ++code) {
+		uint8_t bit = 1 << (code % 8);
+		bool was = device->down[code / 8] & bit, is = down[code / 8] & bit;
+		if (was != is) {
+			report_key(evdev, device, code, is, time);
+		}
+	}
+}
+
+static void handle_events(struct wsk_evdev *evdev,
+		struct wsk_evdev_device *device,
+		const struct input_event *events, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		const struct input_event *event = &events[i];
+		if (event->type == EV_SYN) {
+			if (event->code == SYN_DROPPED) {
+				device->dropped = true;
+			} else if (event->code == SYN_REPORT && device->dropped) {
+				device->dropped = false;
+				resync_keys(evdev, device, event_time(event));
+			}
+			continue;
+		}
+		// Autorepeats (value 2) are counted from the repeat info instead
+		if (device->dropped || event->type != EV_KEY || event->value > 1) {
+			continue;
+		}
+		report_key(evdev, device, event->code, event->value == 1,
+				event_time(event));
+	}
+}
+
+/* Reads all there is to read from device, returns false once it is gone */
+static bool read_device(struct wsk_evdev *evdev,
+		struct wsk_evdev_device *device) {
+	struct input_event events[WSK_EVDEV_BATCH];
+	uint8_t *buf = (uint8_t *)events;
+	while (true) {
+		size_t len = device->partial_len;
+		memcpy(buf, device->partial, len);
+		ssize_t n = read(device->fd, buf + len, sizeof(events) - len);
+		if (n < 0) {
+			return errno == EAGAIN || errno == EINTR;
+		} else if (n == 0) {
+			return false;
+		}
+		len += n;
+		size_t count = len / sizeof(struct input_event);
+		device->partial_len = len % sizeof(struct input_event);
+		memcpy(device->partial, buf + count * sizeof(struct input_event),
+				device->partial_len);
+		handle_events(evdev, device, events, count);
+		if (len < sizeof(events)) {
+			return true;
+		}
+	}
+}
+
+/* Handles whatever is ready; returns 0 or -1 if epoll failed */
+int evdev_dispatch(struct wsk_evdev *evdev) {
+	struct epoll_event ready[16];
+	int n = epoll_wait(evdev->epoll_fd, ready,
+			sizeof(ready) / sizeof(ready[0]), 0);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	/*
+	 * The monitor goes last, as removing a device frees it, and it may still
+	 * be further on in ready
+	 */
+	bool monitor = false;
+	for (int i = 0; i < n; ++i) {
+		struct wsk_evdev_device *device = ready[i].data.ptr;
+		if (!device) {
+			monitor = true;
+		} else if (!read_device(evdev, device)
+				|| (ready[i].events & (EPOLLHUP | EPOLLERR))) {
+			remove_device(evdev, device);
+		}
+	}
+	if (monitor) {
+		handle_monitor(evdev);
+	}
+	return 0;
+}
+
+void evdev_finish(struct wsk_evdev *evdev) {
+	while (evdev->devices) {
+		remove_device(evdev, evdev->devices);
+	}
+	if (evdev->monitor) {
+		udev_monitor_unref(evdev->monitor);
+	}
+	if (evdev->udev) {
+		udev_unref(evdev->udev);
+	}
+	if (evdev->epoll_fd >= 0) {
+		close(evdev->epoll_fd);
+	}
+	free(evdev->seat);
+	memset(evdev, 0, sizeof(struct wsk_evdev));
+	evdev->epoll_fd = -1;
+}
@@ -0,0 +1,56 @@
+#ifndef _WSK_EVDEV_H
+#define _WSK_EVDEV_H
+#include <libudev.h>
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devmgr.h"
+
+/* How many struct input_event are read from a device at once */
+#define WSK_EVDEV_BATCH 256
+
+/* Called for each key press and release; time is in usec, CLOCK_MONOTONIC */
+typedef void (*wsk_evdev_key_func)(void *data,
+		uint32_t keycode, bool pressed, uint64_t time);
+
+struct wsk_evdev_device {
+	int fd;
+	char *devnode; // NULL if added with evdev_add_fd
+	/*
+	 * Events are skipped from a SYN_DROPPED up to the next SYN_REPORT, then
+	 * the keys are brought back in line with the kernel's key state
+	 */
+	bool dropped;
+	/* The keys reported as down, a bit per keycode */
+	uint8_t down[(KEY_CNT + 7) / 8];
+	/* A partial event left over from the last read, on pipes */
+	size_t partial_len;
+	uint8_t partial[32];
+	struct wsk_evdev_device *next;
+};
+
+/*
+ * Reads key events straight from the keyboard event nodes of a udev seat,
+ * opened through devmgr, instead of going through libinput.
+ */
+struct wsk_evdev {
+	int epoll_fd;
+	struct wsk_devmgr *devmgr;
+	char *seat;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	struct wsk_evdev_device *devices;
+	wsk_evdev_key_func key;
+	void *data;
+};
+
+bool evdev_init(struct wsk_evdev *evdev, wsk_evdev_key_func key, void *data);
+bool evdev_assign_seat(struct wsk_evdev *evdev,
+		struct udev *udev, struct wsk_devmgr *devmgr, const char *seat);
+bool evdev_add_fd(struct wsk_evdev *evdev, int fd, const char *devnode);
+int evdev_get_fd(struct wsk_evdev *evdev);
+int evdev_dispatch(struct wsk_evdev *evdev);
+void evdev_finish(struct wsk_evdev *evdev);
+
+#endif
@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "input.h"
+
+_Static_assert((WSK_INPUT_RING_SIZE & (WSK_INPUT_RING_SIZE - 1)) == 0,
+		"WSK_INPUT_RING_SIZE must be a power of two");
+
+static void *input_run(void *data) {
+	struct wsk_input *input = data;
+	while (true) {
+		struct epoll_event ready[16];
+		int n = epoll_wait(input->epoll_fd, ready,
+				sizeof(ready) / sizeof(ready[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		input_lock(input);
+		for (int i = 0; i < n; ++i) {
+			if (!ready[i].data.ptr) {
+				input_unlock(input);
+				return NULL;
+			}
+			// It may have been removed since epoll_wait returned
+			struct wsk_input_source *source = input->sources;
+			while (source && source != ready[i].data.ptr) {
+				source = source->next;
+			}
+			if (source) {
+				source->dispatch(source->data);
+			}
+		}
+		input_unlock(input);
+
+		// One wakeup for everything read in this round
+		if (input->pushed) {
+			input->pushed = false;
+			uint64_t one = 1;
+			if (write(input->wake_fd, &one, sizeof(one)) < 0) {
+				fprintf(stderr, "eventfd write: %s\n", strerror(errno));
+			}
+		}
+	}
+	return NULL;
+}
+
+bool input_start(struct wsk_input *input) {
+	pthread_mutex_init(&input->lock, NULL);
+	atomic_init(&input->head, 0);
+	atomic_init(&input->tail, 0);
+	input->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	input->quit_fd = eventfd(0, EFD_CLOEXEC);
+	input->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (input->epoll_fd < 0 || input->quit_fd < 0 || input->wake_fd < 0) {
+		fprintf(stderr, "Unable to set up the input thread: %s\n",
+				strerror(errno));
+		return false;
+	}
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD,
+				input->quit_fd, &event) != 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return false;
+	}
+
+	// Signals are left to the main thread's signalfd
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&input->thread, NULL, input_run, input);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return false;
+	}
+	input->running = true;
+	return true;
+}
+
+void input_lock(struct wsk_input *input) {
+	pthread_mutex_lock(&input->lock);
+}
+
+void input_unlock(struct wsk_input *input) {
+	pthread_mutex_unlock(&input->lock);
+}
+
+/* Must be called with the lock held */
+bool input_add_source(struct wsk_input *input, int fd,
+		wsk_input_dispatch_func dispatch, void *data) {
+	struct wsk_input_source *source =
+		calloc(1, sizeof(struct wsk_input_source));
+	if (!source) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return false;
+	}
+	source->fd = fd;
+	source->dispatch = dispatch;
+	source->data = data;
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+	if (epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		free(source);
+		return false;
+	}
+	source->next = input->sources;
+	input->sources = source;
+	return true;
+}
+
+/* Must be called with the lock held */
+void input_remove_source(struct wsk_input *input, void *data) {
+	struct wsk_input_source **link = &input->sources;
+	while (*link && (*link)->data != data) {
+		link = &(*link)->next;
+	}
+	struct wsk_input_source *source = *link;
+	if (!source) {
+		return;
+	}
+	*link = source->next;
+	epoll_ctl(input->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	free(source);
+}
+
+/* Input thread only. If the main thread has fallen that far behind, the
+ * newest keys are dropped. */
+void input_push(struct wsk_input *input, const struct wsk_input_key *key) {
+	size_t tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&input->head, memory_order_acquire);
+	if (tail - head == WSK_INPUT_RING_SIZE) {
+		if (input->dropped++ == 0) {
+			fprintf(stderr, "Input is not being kept up with; "
+					"dropping keys\n");
+		}
+		return;
+	}
+	input->ring[tail & (WSK_INPUT_RING_SIZE - 1)] = *key;
+	atomic_store_explicit(&input->tail, tail + 1, memory_order_release);
+	input->pushed = true;
+}
+
+/* Main thread only */
+bool input_pop(struct wsk_input *input, struct wsk_input_key *key) {
+	size_t head = atomic_load_explicit(&input->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&input->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	*key = input->ring[head & (WSK_INPUT_RING_SIZE - 1)];
+	atomic_store_explicit(&input->head, head + 1, memory_order_release);
+	return true;
+}
+
+int input_get_fd(struct wsk_input *input) {
+	return input->wake_fd;
+}
+
+void input_finish(struct wsk_input *input) {
+	if (input->running) {
+		uint64_t one = 1;
+		if (write(input->quit_fd, &one, sizeof(one)) < 0) {
+			fprintf(stderr, "eventfd write: %s\n", strerror(errno));
+		}
+		pthread_join(input->thread, NULL);
+		input->running = false;
+	}
+	while (input->sources) {
+		input_remove_source(input, input->sources->data);
+	}
+	if (input->epoll_fd >= 0) {
+		close(input->epoll_fd);
+	}
+	if (input->quit_fd >= 0) {
+		close(input->quit_fd);
+	}
+	if (input->wake_fd >= 0) {
+		close(input->wake_fd);
+	}
+	pthread_mutex_destroy(&input->lock);
+}
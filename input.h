@@ -0,0 +1,67 @@
+#ifndef _WSK_INPUT_H
+#define _WSK_INPUT_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Must be a power of two */
+#define WSK_INPUT_RING_SIZE 1024
+
+/* A key event on its way from the input thread to the main thread */
+struct wsk_input_key {
+	uint64_t time; // usec, CLOCK_MONOTONIC
+	uint32_t seat; // wl_registry name of the seat
+	uint16_t keycode; // evdev code
+	uint8_t pressed;
+};
+
+/* Runs on the input thread, with the input lock held */
+typedef void (*wsk_input_dispatch_func)(void *data);
+
+struct wsk_input_source {
+	int fd;
+	wsk_input_dispatch_func dispatch;
+	void *data;
+	struct wsk_input_source *next;
+};
+
+/*
+ * Input devices are read on a thread of their own, so that they are drained
+ * however long a frame takes. Keys are handed to the main thread through a
+ * single-producer, single-consumer ring, and wake_fd is signalled after each
+ * round of dispatching which pushed any. The main thread drains the ring
+ * whenever it is woken.
+ *
+ * The lock is held while sources are dispatched. The main thread takes it to
+ * add or remove sources and for anything else which would race with them,
+ * such as opening devices through devmgr.
+ */
+struct wsk_input {
+	pthread_t thread;
+	bool running;
+	pthread_mutex_t lock;
+	int epoll_fd;
+	int quit_fd, wake_fd;
+	struct wsk_input_source *sources;
+
+	struct wsk_input_key ring[WSK_INPUT_RING_SIZE];
+	_Atomic size_t head, tail; // Written by the consumer, producer
+	/* Only touched by the producer */
+	size_t dropped;
+	bool pushed;
+};
+
+bool input_start(struct wsk_input *input);
+void input_lock(struct wsk_input *input);
+void input_unlock(struct wsk_input *input);
+bool input_add_source(struct wsk_input *input, int fd,
+		wsk_input_dispatch_func dispatch, void *data);
+void input_remove_source(struct wsk_input *input, void *data);
+void input_push(struct wsk_input *input, const struct wsk_input_key *key);
+bool input_pop(struct wsk_input *input, struct wsk_input_key *key);
+int input_get_fd(struct wsk_input *input);
+void input_finish(struct wsk_input *input);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Display labels for special keys, looked up through a perfect hash of
+ * their keysyms which is built once at startup.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <xkbcommon/xkbcommon.h>
+#include "keysym.h"
+
+static const struct {
+	xkb_keysym_t sym;
+	const char *text;
+} labels[] = {
+	{ XKB_KEY_space, "␣" },
+	{ XKB_KEY_Return, "⏎" },
+	{ XKB_KEY_KP_Enter, "⏎" },
+	{ XKB_KEY_BackSpace, "⌫" },
+	{ XKB_KEY_Delete, "⌦" },
+	{ XKB_KEY_Tab, "⇥" },
+	{ XKB_KEY_ISO_Left_Tab, "⇤" },
+	{ XKB_KEY_Escape, "Esc" },
+	{ XKB_KEY_Insert, "Ins" },
+	{ XKB_KEY_Home, "Home" },
+	{ XKB_KEY_End, "End" },
+	{ XKB_KEY_Page_Up, "PgUp" },
+	{ XKB_KEY_Page_Down, "PgDn" },
+	{ XKB_KEY_Left, "←" },
+	{ XKB_KEY_Up, "↑" },
+	{ XKB_KEY_Right, "→" },
+	{ XKB_KEY_Down, "↓" },
+	{ XKB_KEY_Caps_Lock, "⇪" },
+	{ XKB_KEY_Num_Lock, "Num" },
+	{ XKB_KEY_Scroll_Lock, "ScrLk" },
+	{ XKB_KEY_Print, "PrtSc" },
+	{ XKB_KEY_Pause, "Pause" },
+	{ XKB_KEY_Menu, "Menu" },
+	/* Modifiers read as the start of a chord */
+	{ XKB_KEY_Shift_L, "⇧+" },
+	{ XKB_KEY_Shift_R, "⇧+" },
+	{ XKB_KEY_Control_L, "Ctrl+" },
+	{ XKB_KEY_Control_R, "Ctrl+" },
+	{ XKB_KEY_Alt_L, "Alt+" },
+	{ XKB_KEY_Alt_R, "Alt+" },
+	{ XKB_KEY_ISO_Level3_Shift, "AltGr+" },
+	{ XKB_KEY_Meta_L, "Meta+" },
+	{ XKB_KEY_Meta_R, "Meta+" },
+	{ XKB_KEY_Super_L, "Super+" },
+	{ XKB_KEY_Super_R, "Super+" },
+	{ XKB_KEY_Hyper_L, "Hyper+" },
+	{ XKB_KEY_Hyper_R, "Hyper+" },
+	{ XKB_KEY_XF86AudioMute, "🔇" },
+	{ XKB_KEY_XF86AudioLowerVolume, "🔉" },
+	{ XKB_KEY_XF86AudioRaiseVolume, "🔊" },
+	{ XKB_KEY_XF86AudioPlay, "⏯" },
+	{ XKB_KEY_XF86AudioPrev, "⏮" },
+	{ XKB_KEY_XF86AudioNext, "⏭" },
+	{ XKB_KEY_XF86MonBrightnessDown, "🔅" },
+	{ XKB_KEY_XF86MonBrightnessUp, "🔆" },
+};
+
+#define NLABELS (sizeof(labels) / sizeof(labels[0]))
+#define MAX_HASH_BITS 12
+
+/* Slot -> index into labels + 1, or 0 if empty */
+static uint8_t slots[1 << MAX_HASH_BITS];
+static uint32_t hash_mult;
+static unsigned int hash_bits;
+
+static uint32_t hash_slot(xkb_keysym_t sym, uint32_t mult, unsigned int bits) {
+	return (uint32_t)(sym * mult) >> (32 - bits);
+}
+
+static bool try_hash(uint32_t mult, unsigned int bits) {
+	memset(slots, 0, sizeof(slots));
+	for (size_t i = 0; i < NLABELS; ++i) {
+		uint32_t slot = hash_slot(labels[i].sym, mult, bits);
+		if (slots[slot] && labels[slots[slot] - 1].sym != labels[i].sym) {
+			return false;
+		}
+		slots[slot] = i + 1;
+	}
+	return true;
+}
+
+void keysym_labels_init(void) {
+	/* Multiplicative hashing with the first multiplier that's collision free */
+	uint32_t x = 2463534242u;
+	for (hash_bits = 7; hash_bits <= MAX_HASH_BITS; ++hash_bits) {
+		for (int attempt = 0; attempt < 10000; ++attempt) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			hash_mult = x | 1;
+			if (try_hash(hash_mult, hash_bits)) {
+				return;
+			}
+		}
+	}
+	/* Not reached with a table this small; all keys would show their names */
+	hash_bits = MAX_HASH_BITS;
+	memset(slots, 0, sizeof(slots));
+}
+
+uint16_t keysym_label_find(xkb_keysym_t sym) {
+	uint8_t slot = slots[hash_slot(sym, hash_mult, hash_bits)];
+	if (slot && labels[slot - 1].sym == sym) {
+		return slot - 1;
+	}
+	return KEYSYM_LABEL_NAME;
+}
+
+/* Labels are numbered from 0 to this */
+size_t keysym_label_count(void) {
+	return NLABELS;
+}
+
+const char *keysym_label_text(xkb_keysym_t sym, uint16_t label,
+		char *buf, size_t size) {
+	switch (label) {
+	case KEYSYM_LABEL_CHAR:
+		if (xkb_keysym_to_utf8(sym, buf, size) <= 0) {
+			buf[0] = '\0';
+		}
+		return buf;
+	case KEYSYM_LABEL_NAME:
+		if (xkb_keysym_get_name(sym, buf, size) < 0) {
+			snprintf(buf, size, "%#x", sym);
+		}
+		return buf;
+	default:
+		return labels[label].text;
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef _WSK_KEYSYM_H
+#define _WSK_KEYSYM_H
+#include <stddef.h>
+#include <stdint.h>
+#include <xkbcommon/xkbcommon.h>
+
+/* Label indices for keys which aren't in the table */
+#define KEYSYM_LABEL_CHAR 0xFFFF // drawn as the character it produces
+#define KEYSYM_LABEL_NAME 0xFFFE // drawn as its XKB keysym name
+
+void keysym_labels_init(void);
+uint16_t keysym_label_find(xkb_keysym_t sym);
+size_t keysym_label_count(void);
+const char *keysym_label_text(xkb_keysym_t sym, uint16_t label,
+		char *buf, size_t size);
+
+#endif
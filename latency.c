@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdio.h>
+#include "latency.h"
+
+static const char *stage_names[WSK_LATENCY_STAGES] = {
+	[WSK_LATENCY_INPUT_RENDER] = "input->render",
+	[WSK_LATENCY_RENDER_COMMIT] = "render->commit",
+	[WSK_LATENCY_COMMIT_PRESENT] = "commit->present",
+	[WSK_LATENCY_INPUT_PRESENT] = "input->present",
+};
+
+static size_t bucket_of(uint64_t usec) {
+	size_t bucket = 0;
+	while (usec > 1 && bucket < WSK_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+void latency_add(struct wsk_latency *latency,
+		enum wsk_latency_stage stage, uint64_t usec) {
+	struct wsk_histogram *histogram = &latency->stages[stage];
+	++histogram->buckets[bucket_of(usec)];
+	++histogram->count;
+	histogram->sum += usec;
+	if (usec > histogram->max) {
+		histogram->max = usec;
+	}
+}
+
+/* Upper bound of the bucket the given percentile falls in */
+static uint64_t percentile(struct wsk_histogram *histogram, unsigned int p) {
+	uint64_t rank = (histogram->count * p + 99) / 100, seen = 0;
+	for (size_t i = 0; i < WSK_LATENCY_BUCKETS; ++i) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			uint64_t bound = (uint64_t)2 << i;
+			return bound < histogram->max ? bound : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+void latency_dump(struct wsk_latency *latency, FILE *f) {
+	fprintf(f, "%-16s %8s %8s %8s %8s %8s %8s (usec)\n", "latency",
+			"count", "mean", "p50", "p90", "p99", "max");
+	for (size_t i = 0; i < WSK_LATENCY_STAGES; ++i) {
+		struct wsk_histogram *histogram = &latency->stages[i];
+		if (histogram->count == 0) {
+			fprintf(f, "%-16s %8d\n", stage_names[i], 0);
+			continue;
+		}
+		fprintf(f, "%-16s %8lu %8lu %8lu %8lu %8lu %8lu\n", stage_names[i],
+				(unsigned long)histogram->count,
+				(unsigned long)(histogram->sum / histogram->count),
+				(unsigned long)percentile(histogram, 50),
+				(unsigned long)percentile(histogram, 90),
+				(unsigned long)percentile(histogram, 99),
+				(unsigned long)histogram->max);
+		for (size_t j = 0; j < WSK_LATENCY_BUCKETS; ++j) {
+			if (histogram->buckets[j]) {
+				fprintf(f, "%16s <%lu: %lu\n", "",
+						(unsigned long)((uint64_t)2 << j),
+						(unsigned long)histogram->buckets[j]);
+			}
+		}
+	}
+	fflush(f);
+}
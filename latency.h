@@ -0,0 +1,30 @@
+#ifndef _WSK_LATENCY_H
+#define _WSK_LATENCY_H
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bucket i counts latencies of [2^i, 2^(i+1)) usec; bucket 0 includes 0 */
+#define WSK_LATENCY_BUCKETS 32
+
+enum wsk_latency_stage {
+	WSK_LATENCY_INPUT_RENDER,
+	WSK_LATENCY_RENDER_COMMIT,
+	WSK_LATENCY_COMMIT_PRESENT,
+	WSK_LATENCY_INPUT_PRESENT,
+	WSK_LATENCY_STAGES,
+};
+
+struct wsk_histogram {
+	uint64_t buckets[WSK_LATENCY_BUCKETS];
+	uint64_t count, sum, max; // usec
+};
+
+struct wsk_latency {
+	struct wsk_histogram stages[WSK_LATENCY_STAGES];
+};
+
+void latency_add(struct wsk_latency *latency,
+		enum wsk_latency_stage stage, uint64_t usec);
+void latency_dump(struct wsk_latency *latency, FILE *f);
+
+#endif
@@ -5,78 +5,390 @@
 #include <libinput.h>
 #include <libudev.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <xkbcommon/xkbcommon.h>
 #include "devmgr.h"
-#include "shm.h"
+#include "evdev.h"
+#include "input.h"
+#include "keysym.h"
+#include "latency.h"
 #include "pango.h"
+#include "record.h"
+#include "render.h"
+#include "shm.h"
+#include "worker.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
-struct wsk_keypress {
-	xkb_keysym_t sym;
-	char name[128];
-	char utf8[128];
-	struct wsk_keypress *next;
-};
+struct wsk_state;
+struct wsk_seat;
 
 struct wsk_output {
+	struct wsk_state *state;
 	struct wl_output *output;
+	struct zxdg_output_v1 *xdg_output;
+	uint32_t global;
+	char *name;
 	int scale;
 	enum wl_output_subpixel subpixel;
 	struct wsk_output *next;
 };
 
-struct wsk_state {
-	int devmgr;
-	pid_t devmgr_pid;
-	struct udev *udev;
+/* -S: a key's label drawn once, shared by every key and surface showing it */
+struct wsk_key_buffer {
+	xkb_keysym_t sym;
+	uint16_t label, repeat;
+	struct wsk_key_box box;
+	struct pool_buffer buffer;
+	/* Key surfaces showing it, and whether the keys as laid out last do */
+	size_t refs;
+	bool used;
+	struct wsk_key_buffer *next;
+};
+
+/* -S: where a key goes, as laid out for its view */
+struct wsk_key_slot {
+	struct wsk_key_buffer *buffer; // NULL if it isn't shown
+	int32_t x; // surface pixels
+};
+
+/* -S: the subsurface showing one key on a surface */
+struct wsk_key_surface {
+	uint64_t seq;
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct wsk_key_buffer *buffer;
+	int32_t x;
+};
+
+/*
+ * Keys drawn for one scale (in 120ths) and subpixel order. The buffers are
+ * attached to every surface on an output like that, so the keys are only
+ * drawn once. They are drawn by the render worker, which owns the renderer
+ * and pool.
+ */
+struct wsk_view {
+	struct wsk_seat *seat;
+	int scale;
+	enum wl_output_subpixel subpixel;
+	struct wsk_renderer renderer;
+	struct shm_pool pool;
+	struct wsk_render_job job;
+	/* For the next job */
+	uint64_t changed_seq;
+	struct pool_buffer *unused;
+	/*
+	 * When the job in flight was started, and the newest key it shows. The
+	 * key is kept until a frame with it is committed.
+	 */
+	uint64_t render_time, input_time;
+	/* Whether the last frame had keys animating out */
+	bool animating;
+	/* Counts the frames drawn, so surfaces know if they showed the last */
+	uint64_t frames;
+	bool frame_scheduled, dirty;
+	/* No buffer was free; retried after the next Wayland events */
+	bool starved;
+	/* Frames are paced by a callback on one of the surfaces */
+	struct wl_callback *frame_callback;
+	struct wsk_surface *frame_surface;
+	/*
+	 * -S: the labels drawn so far, the keys as laid out last, and the
+	 * transparent buffer the surfaces themselves are given
+	 */
+	struct wsk_key_buffer *key_buffers;
+	struct wsk_key_slot *slots;
+	struct pool_buffer blank;
+	struct wsk_view *next;
+};
+
+struct wsk_surface {
+	struct wsk_seat *seat;
+	/* The output it is shown on, once known */
+	struct wsk_output *output;
+	struct wsk_view *view;
+	struct wl_surface *surface;
+	struct zwlr_layer_surface_v1 *layer_surface;
+	/* Only with both wp_viewporter and wp_fractional_scale_manager_v1 */
+	struct wp_viewport *viewport;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	uint32_t preferred_scale; // in 120ths, 0 until the compositor says
+	/* As configured, and as last asked for; configured is 0 until then */
+	uint32_t width, height;
+	uint32_t requested_width, requested_height;
+	bool configured;
+	/* The frame of the view it shows, 0 if none */
+	uint64_t frame;
+	/* How far it is moved to make room for other seats' overlays */
+	uint32_t offset;
+	/* -S: the subsurfaces of the keys shown, oldest first */
+	struct wsk_key_surface *keys, *spare;
+	size_t nkeys;
+	struct wsk_surface *next;
+};
+
+/*
+ * Each seat has its own keyboard state, keys and overlay. Its devices are
+ * read by a libinput context assigned to the udev seat of the same name, or
+ * straight from their event nodes with -I evdev, so every device is still
+ * only opened once, through the one devmgr. Either is only touched by the
+ * input thread once it has been set up, or with the input lock held.
+ */
+struct wsk_seat {
+	struct wsk_state *state;
+	struct wl_seat *seat;
+	uint32_t global;
+	char *name;
+	struct wl_keyboard *keyboard;
 	struct libinput *libinput;
+	struct wsk_evdev *evdev;
+
+	struct xkb_state *xkb_state;
+	struct xkb_keymap *xkb_keymap;
+	int32_t repeat_rate, repeat_delay; // keys/sec, msec
+
+	/* The last key, while it is held down and auto-repeating */
+	bool held;
+	uint32_t held_keycode;
+	uint64_t held_seq, held_since;
+	uint32_t held_base;
+
+	struct wsk_keys keys;
+	struct wsk_view *views;
+	struct wsk_seat *next;
+};
 
-	uint32_t foreground, background, specialfg;
-	const char *font;
-	int timeout;
+/* An event node and the udev seat it is on, as found at startup */
+struct wsk_udev_node {
+	char *devnode, *seat;
+	struct wsk_udev_node *next;
+};
+
+struct wsk_state {
+	struct wsk_devmgr devmgr;
+	struct udev *udev;
+	/*
+	 * The event nodes of all seats, enumerated once when the first seat is
+	 * named. Only used to prefetch; the backends find hotplugged ones.
+	 */
+	struct wsk_udev_node *udev_nodes;
+	bool udev_scanned;
+	/* -I evdev: read keyboards directly rather than through libinput */
+	bool use_evdev;
+	struct wsk_input input;
+
+	struct wsk_render_config config;
+	size_t max_keys;
 
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
-	struct wl_seat *seat;
-	struct wl_keyboard *keyboard;
+	struct wsk_seat *seats;
 	struct zxdg_output_manager_v1 *output_mgr;
 	struct zwlr_layer_shell_v1 *layer_shell;
+	struct wp_presentation *presentation;
+	uint32_t presentation_clock;
+	struct wp_viewporter *viewporter;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_mgr;
+
+	unsigned int anchor;
+	int margin;
+	/* -o: the name of the output to show keys on, "all", or NULL to let the
+	 * compositor pick one */
+	const char *output_name;
+	struct wsk_output *outputs;
+	struct wsk_surface *surfaces;
+	struct wsk_worker worker;
+	/* Last presentation time (usec) and refresh period (nsec), if known */
+	uint64_t last_present;
+	uint32_t refresh;
+	size_t nbuffers;
+	/* -S: show each key as a subsurface of its own */
+	bool subsurfaces;
+	struct wsk_label_cache labels;
 
-	struct wl_surface *surface;
-	struct zwlr_layer_surface_v1 *layer_surface;
-	uint32_t width, height;
-	bool frame_scheduled, dirty;
-	struct pool_buffer buffers[2];
-	struct pool_buffer *current_buffer;
-	struct wsk_output *output, *outputs;
-
-	struct xkb_state *xkb_state;
 	struct xkb_context *xkb_context;
-	struct xkb_keymap *xkb_keymap;
 
-	struct wsk_keypress *keys;
-	struct timespec last_key;
+	/* Armed for when the oldest key of any seat starts to animate out or
+	 * expires */
+	int timer_fd;
+	uint64_t timer_deadline;
+
+	/* Input logged with -r, or replayed with -R into the first seat in place
+	 * of libinput */
+	struct wsk_recorder recorder;
+	struct wsk_replay replay;
+	bool replay_fast;
+	int replay_fd;
+	/* Added to recorded timestamps to replay them in real time */
+	uint64_t replay_base;
+
+	/*
+	 * Latency stats for -L, dumped on SIGUSR1 and at exit; SIGINT and
+	 * SIGTERM then come through signal_fd too, so that exit is reached
+	 */
+	struct wsk_latency *latency;
+	int signal_fd;
+	/* The newest key event not yet committed, in usec, or 0 */
+	uint64_t input_time;
 
 	bool run;
 };
 
-static void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
-	cairo_set_source_rgba(cairo,
-			(color >> (3*8) & 0xFF) / 255.0,
-			(color >> (2*8) & 0xFF) / 255.0,
-			(color >> (1*8) & 0xFF) / 255.0,
-			(color >> (0*8) & 0xFF) / 255.0);
+/*
+ * Renders are deferred until all pending events have been handled and then
+ * paced by frame callbacks, so a burst of keys is drawn in a single frame.
+ */
+static void set_dirty(struct wsk_seat *seat) {
+	for (struct wsk_view *view = seat->views; view; view = view->next) {
+		view->dirty = true;
+	}
+}
+
+static uint64_t now_usec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t key_deadline(struct wsk_state *state,
+		struct wsk_keypress *key, uint64_t now) {
+	uint64_t deadline = key->time + state->config.timeout;
+	if (state->config.animation != WSK_ANIMATION_NONE && deadline <= now) {
+		deadline += WSK_ANIMATION_DURATION;
+	}
+	return deadline;
+}
+
+static void key_changed(struct wsk_seat *seat, uint64_t seq) {
+	for (struct wsk_view *view = seat->views; view; view = view->next) {
+		if (seq < view->changed_seq) {
+			view->changed_seq = seq;
+		}
+	}
+	set_dirty(seat);
+}
+
+/*
+ * Counts the repeats the compositor would have generated for the held key
+ * by now, using its repeat rate and delay.
+ */
+static void update_held_key(struct wsk_seat *seat, uint64_t now) {
+	if (!seat->held) {
+		return;
+	} else if (seat->held_seq < seat->keys.seq) {
+		// It expired while held
+		seat->held = false;
+		return;
+	}
+	uint64_t start = seat->held_since + (uint64_t)seat->repeat_delay * 1000;
+	if (now < start) {
+		return;
+	}
+	struct wsk_keypress *key =
+		keys_at(&seat->keys, seat->held_seq - seat->keys.seq);
+	uint64_t repeat = seat->held_base + 1
+		+ (now - start) * seat->repeat_rate / 1000000;
+	if (repeat > UINT16_MAX) {
+		repeat = UINT16_MAX;
+	}
+	if (key->repeat != repeat) {
+		key->repeat = repeat;
+		key->time = now;
+		key_changed(seat, seat->held_seq);
+	}
+}
+
+/* When update_held_key next has something to count, or 0 */
+static uint64_t held_key_deadline(struct wsk_seat *seat) {
+	if (!seat->held || seat->held_seq < seat->keys.seq
+			|| seat->repeat_rate <= 0) {
+		return 0;
+	}
+	struct wsk_keypress *key =
+		keys_at(&seat->keys, seat->held_seq - seat->keys.seq);
+	uint64_t repeats = key->repeat - seat->held_base;
+	return seat->held_since + (uint64_t)seat->repeat_delay * 1000
+		+ repeats * 1000000 / seat->repeat_rate;
+}
+
+/* Repeats can be turned off while a key is held, with a rate of 0 */
+static void set_repeat_info(struct wsk_seat *seat,
+		int32_t rate, int32_t delay) {
+	seat->repeat_rate = rate;
+	seat->repeat_delay = delay;
+	if (rate <= 0) {
+		seat->held = false;
+	}
+}
+
+/*
+ * Re-arms the timer for the next deadline of the oldest key or the next
+ * repeat of the held key on any seat, or disarms it
+ */
+static void update_timer(struct wsk_state *state) {
+	uint64_t deadline = 0, now = now_usec();
+	for (struct wsk_seat *seat = state->seats; seat; seat = seat->next) {
+		uint64_t next = 0;
+		if (seat->keys.len) {
+			next = key_deadline(state, keys_at(&seat->keys, 0), now);
+		}
+		uint64_t held = held_key_deadline(seat);
+		if (held && (!next || held < next)) {
+			next = held;
+		}
+		if (next && (!deadline || next < deadline)) {
+			deadline = next;
+		}
+	}
+	if (deadline == state->timer_deadline) {
+		return;
+	}
+	state->timer_deadline = deadline;
+
+	struct itimerspec spec = { 0 };
+	if (deadline) {
+		spec.it_value.tv_sec = deadline / 1000000;
+		spec.it_value.tv_nsec = deadline % 1000000 * 1000;
+	}
+	if (timerfd_settime(state->timer_fd, TFD_TIMER_ABSTIME,
+				&spec, NULL) != 0) {
+		fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+	}
+}
+
+static void expire_keys(struct wsk_seat *seat) {
+	struct wsk_state *state = seat->state;
+	uint64_t now = now_usec();
+	uint64_t linger = state->config.timeout;
+	if (state->config.animation != WSK_ANIMATION_NONE) {
+		linger += WSK_ANIMATION_DURATION;
+	}
+
+	struct wsk_keys *keys = &seat->keys;
+	size_t len = keys->len;
+	while (keys->len && keys_at(keys, 0)->time + linger <= now) {
+		keys_drop_oldest(keys);
+	}
+	// Also redraw when the oldest key starts to animate out
+	if (keys->len != len || state->config.animation != WSK_ANIMATION_NONE) {
+		set_dirty(seat);
+	}
 }
 
 static cairo_subpixel_order_t to_cairo_subpixel_order(
@@ -96,129 +408,652 @@ static cairo_subpixel_order_t to_cairo_subpixel_order(
 	return CAIRO_SUBPIXEL_ORDER_DEFAULT;
 }
 
-static void render_to_cairo(cairo_t *cairo, struct wsk_state *state,
-		int scale, uint32_t *width, uint32_t *height) {
-	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_u32(cairo, state->background);
-	cairo_paint(cairo);
-
-	struct wsk_keypress *key = state->keys;
-	while (key) {
-		bool special = false;
-		const char *name = key->utf8;
-		if (!name[0]) {
-			special = true;
-			cairo_set_source_u32(cairo, state->specialfg);
-			name = key->name;
-		} else {
-			cairo_set_source_u32(cairo, state->foreground);
+/*
+ * When the next frame will reach the screen, predicted from presentation
+ * feedback when we have it.
+ */
+static uint64_t frame_target_time(struct wsk_state *state) {
+	uint64_t now = now_usec();
+	if (!state->last_present || !state->refresh
+			|| state->last_present > now) {
+		return now;
+	}
+	uint64_t refresh = state->refresh / 1000;
+	if (refresh == 0) {
+		return now;
+	}
+	uint64_t frames = (now - state->last_present) / refresh + 1;
+	return state->last_present + frames * refresh;
+}
+
+/* A commit waiting for presentation feedback */
+struct wsk_feedback {
+	struct wsk_state *state;
+	uint64_t input_time, commit_time; // usec
+};
+
+static void feedback_sync_output(void *data,
+		struct wp_presentation_feedback *feedback, struct wl_output *output) {
+	// Who cares
+}
+
+static void feedback_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct wsk_feedback *wsk_feedback = data;
+	struct wsk_state *state = wsk_feedback->state;
+	wp_presentation_feedback_destroy(feedback);
+	if (state->presentation_clock != CLOCK_MONOTONIC) {
+		free(wsk_feedback);
+		return;
+	}
+	uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+	uint64_t present = sec * 1000000 + tv_nsec / 1000;
+	state->last_present = present;
+	state->refresh = refresh;
+
+	if (state->latency && wsk_feedback->input_time) {
+		uint64_t commit = wsk_feedback->commit_time;
+		uint64_t input = wsk_feedback->input_time;
+		latency_add(state->latency, WSK_LATENCY_COMMIT_PRESENT,
+				present > commit ? present - commit : 0);
+		latency_add(state->latency, WSK_LATENCY_INPUT_PRESENT,
+				present > input ? present - input : 0);
+	}
+	free(wsk_feedback);
+}
+
+static void feedback_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback);
+	free(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_sync_output,
+	.presented = feedback_presented,
+	.discarded = feedback_discarded,
+};
+
+static void render_view(struct wsk_view *view);
+
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct wsk_view *view = data;
+	wl_callback_destroy(callback);
+	view->frame_callback = NULL;
+	view->frame_surface = NULL;
+	view->frame_scheduled = false;
+	if (view->dirty || view->animating) {
+		render_view(view);
+	}
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+static void view_cancel_frame(struct wsk_view *view) {
+	if (view->frame_callback) {
+		wl_callback_destroy(view->frame_callback);
+		view->frame_callback = NULL;
+	}
+	view->frame_surface = NULL;
+	view->frame_scheduled = false;
+}
+
+static struct wsk_view *get_view(struct wsk_seat *seat,
+		int scale, enum wl_output_subpixel subpixel) {
+	struct wsk_state *state = seat->state;
+	struct wsk_view **link = &seat->views;
+	for (; *link; link = &(*link)->next) {
+		if ((*link)->scale == scale && (*link)->subpixel == subpixel) {
+			return *link;
 		}
+	}
+	struct wsk_view *view = calloc(1, sizeof(struct wsk_view));
+	if (!view) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (!keys_init(&view->job.keys, seat->keys.max)) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		free(view);
+		return NULL;
+	}
+	if (state->subsurfaces && !(view->slots =
+				calloc(seat->keys.max, sizeof(struct wsk_key_slot)))) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		keys_finish(&view->job.keys);
+		free(view);
+		return NULL;
+	}
+	view->seat = seat;
+	view->scale = scale;
+	view->subpixel = subpixel;
+	renderer_init(&view->renderer, &state->config, &state->labels);
+	view->renderer.subpixel = to_cairo_subpixel_order(subpixel);
+	shm_pool_init(&view->pool, state->worker.shm, state->nbuffers);
+	view->changed_seq = UINT64_MAX;
+	view->dirty = true;
+	*link = view;
+	return view;
+}
 
-		cairo_move_to(cairo, *width, 0);
+static void view_destroy(struct wsk_view *view) {
+	struct wsk_view **link = &view->seat->views;
+	while (*link != view) {
+		link = &(*link)->next;
+	}
+	*link = view->next;
+	view_cancel_frame(view);
+	struct wsk_worker *worker = &view->seat->state->worker;
+	worker_cancel(worker, &view->job);
+	worker_lock(worker);
+	shm_pool_finish(&view->pool);
+	renderer_finish(&view->renderer);
+	worker_unlock(worker);
+	keys_finish(&view->job.keys);
+	struct wsk_key_buffer *buffer = view->key_buffers, *next;
+	for (; buffer; buffer = next) {
+		next = buffer->next;
+		destroy_single_buffer(&buffer->buffer);
+		free(buffer);
+	}
+	destroy_single_buffer(&view->blank);
+	free(view->slots);
+	free(view);
+}
 
-		int w, h;
-		if (special) {
-			get_text_size(cairo, state->font, &w, &h, NULL, scale, "%s+", name);
-			pango_printf(cairo, state->font, scale,  "%s+", name);
-		} else {
-			get_text_size(cairo, state->font, &w, &h, NULL, scale, "%s", name);
-			pango_printf(cairo, state->font, scale,  "%s", name);
+/* Destroys view if no surface shows it any more */
+static void view_unref(struct wsk_view *view) {
+	struct wsk_surface *surface = view->seat->state->surfaces;
+	for (; surface; surface = surface->next) {
+		if (surface->view == view) {
+			return;
 		}
+	}
+	view_destroy(view);
+}
+
+/*
+ * Lets clicks through the surface, including the margin the width is rounded
+ * up with, to whatever is underneath
+ */
+static void set_empty_input_region(struct wsk_state *state,
+		struct wl_surface *wl_surface) {
+	struct wl_region *region = wl_compositor_create_region(state->compositor);
+	wl_surface_set_input_region(wl_surface, region);
+	wl_region_destroy(region);
+}
 
-		*width = *width + w;
-		if ((int)*height < h) {
-			*height = h;
+static void key_surface_destroy(struct wsk_key_surface *key) {
+	if (key->buffer) {
+		--key->buffer->refs;
+	}
+	wl_subsurface_destroy(key->subsurface);
+	wl_surface_destroy(key->surface);
+}
+
+/* -S: takes the subsurfaces of all keys off surface */
+static void surface_clear_keys(struct wsk_surface *surface) {
+	for (size_t i = 0; i < surface->nkeys; ++i) {
+		key_surface_destroy(&surface->keys[i]);
+	}
+	surface->nkeys = 0;
+}
+
+/*
+ * -S: brings the subsurfaces of surface in line with the keys as laid out
+ * for its view. Only keys which are new or changed get a buffer attached;
+ * the others are at most moved, and those gone are destroyed. It all takes
+ * effect with the next commit of surface.
+ */
+static void surface_update_keys(struct wsk_surface *surface) {
+	struct wsk_state *state = surface->seat->state;
+	struct wsk_view *view = surface->view;
+	struct wsk_keys *keys = &surface->seat->keys;
+	size_t j = 0, n = 0;
+	for (size_t i = 0; i < keys->len; ++i) {
+		uint64_t seq = keys->seq + i;
+		struct wsk_key_slot *slot = &view->slots[i];
+		while (j < surface->nkeys && surface->keys[j].seq < seq) {
+			key_surface_destroy(&surface->keys[j++]);
+		}
+		struct wsk_key_surface key = {0};
+		bool found = j < surface->nkeys && surface->keys[j].seq == seq;
+		if (found) {
+			key = surface->keys[j++];
+		}
+		if (!slot->buffer) {
+			if (found) {
+				key_surface_destroy(&key);
+			}
+			continue;
+		}
+
+		if (!found) {
+			key.seq = seq;
+			key.surface = wl_compositor_create_surface(state->compositor);
+			assert(key.surface);
+			key.subsurface = wl_subcompositor_get_subsurface(
+					state->subcompositor, key.surface, surface->surface);
+			assert(key.subsurface);
+			set_empty_input_region(state, key.surface);
+			key.x = INT32_MIN;
 		}
-		key = key->next;
+		if (key.buffer != slot->buffer) {
+			struct pool_buffer *buffer = &slot->buffer->buffer;
+			wl_surface_set_buffer_scale(key.surface,
+					view->scale / WSK_SCALE_BASE);
+			wl_surface_attach(key.surface, buffer->buffer, 0, 0);
+			wl_surface_damage_buffer(key.surface,
+					0, 0, buffer->width, buffer->height);
+			// Held back until the parent is committed
+			wl_surface_commit(key.surface);
+			if (key.buffer) {
+				--key.buffer->refs;
+			}
+			key.buffer = slot->buffer;
+			++key.buffer->refs;
+		}
+		if (key.x != slot->x) {
+			wl_subsurface_set_position(key.subsurface, slot->x, 0);
+			key.x = slot->x;
+		}
+		surface->spare[n++] = key;
+	}
+	while (j < surface->nkeys) {
+		key_surface_destroy(&surface->keys[j++]);
+	}
+	struct wsk_key_surface *shown = surface->spare;
+	surface->spare = surface->keys;
+	surface->keys = shown;
+	surface->nkeys = n;
+}
+
+/* Moves surface to the view matching its output */
+static void surface_update_view(struct wsk_surface *surface) {
+	int scale = surface->preferred_scale;
+	if (scale == 0) {
+		scale = (surface->output ? surface->output->scale : 1)
+			* WSK_SCALE_BASE;
+	}
+	enum wl_output_subpixel subpixel = surface->output ?
+		surface->output->subpixel : WL_OUTPUT_SUBPIXEL_UNKNOWN;
+	struct wsk_view *old = surface->view;
+	if (old && old->scale == scale && old->subpixel == subpixel) {
+		return;
+	}
+	struct wsk_view *view = get_view(surface->seat, scale, subpixel);
+	if (!view) {
+		return;
+	}
+	// The labels of the subsurfaces belong to the old view
+	surface_clear_keys(surface);
+	surface->view = view;
+	surface->frame = 0;
+	view->dirty = true;
+	if (old) {
+		if (old->frame_surface == surface) {
+			view_cancel_frame(old);
+		}
+		view_unref(old);
 	}
 }
 
-static void render_frame(struct wsk_state *state) {
-	cairo_surface_t *recorder = cairo_recording_surface_create(
-			CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_t *cairo = cairo_create(recorder);
-	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-	cairo_font_options_t *fo = cairo_font_options_create();
-	cairo_font_options_set_hint_style(fo, CAIRO_HINT_STYLE_FULL);
-	cairo_font_options_set_antialias(fo, CAIRO_ANTIALIAS_SUBPIXEL);
-	if (state->output) {
-		cairo_font_options_set_subpixel_order(
-				fo, to_cairo_subpixel_order(state->output->subpixel));
+static void commit_view(struct wsk_view *view);
+
+/* -S: the buffer showing key at view's scale, drawn if it is new */
+static struct wsk_key_buffer *get_key_buffer(struct wsk_view *view,
+		struct wsk_keypress *key) {
+	struct wsk_state *state = view->seat->state;
+	struct wsk_key_buffer *buffer = view->key_buffers;
+	for (; buffer; buffer = buffer->next) {
+		if (buffer->sym == key->sym && buffer->label == key->label
+				&& buffer->repeat == key->repeat) {
+			return buffer;
+		}
+	}
+	struct wsk_key_box box;
+	if (!render_key_box(&view->renderer, key, view->scale, &box)) {
+		return NULL;
 	}
-	cairo_set_font_options(cairo, fo);
-	cairo_font_options_destroy(fo);
-	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
+	buffer = calloc(1, sizeof(struct wsk_key_buffer));
+	if (!buffer) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (!create_single_buffer(&buffer->buffer, state->shm,
+				box.buffer_width, box.buffer_height)) {
+		fprintf(stderr, "Unable to create a buffer: %s\n", strerror(errno));
+		free(buffer);
+		return NULL;
+	}
+	render_key(&view->renderer, key, view->scale, &buffer->buffer);
+	buffer->sym = key->sym;
+	buffer->label = key->label;
+	buffer->repeat = key->repeat;
+	buffer->box = box;
+	buffer->next = view->key_buffers;
+	view->key_buffers = buffer;
+	return buffer;
+}
 
-	int scale = state->output ? state->output->scale : 1;
+/*
+ * -S: lays the keys out side by side, drawing only labels the view has no
+ * buffer for yet, and commits the result right away. The surfaces
+ * themselves get a transparent buffer of their size, which is only
+ * re-created when that changes.
+ */
+static void layout_view(struct wsk_view *view) {
+	struct wsk_seat *seat = view->seat;
+	struct wsk_state *state = seat->state;
+	struct wsk_keys *keys = &seat->keys;
+	int scale = view->scale;
+
+	struct wsk_key_buffer *buffer;
+	for (buffer = view->key_buffers; buffer; buffer = buffer->next) {
+		buffer->used = false;
+	}
 	uint32_t width = 0, height = 0;
-	render_to_cairo(cairo, state, scale, &width, &height);
-	if (height / scale != state->height
-			|| width / scale != state->width
-			|| state->width == 0) {
-		// Reconfigure surface
-		if (width == 0 || height == 0) {
-			wl_surface_attach(state->surface, NULL, 0, 0);
+	// The labels and atlas are shared with the render worker
+	worker_lock(&state->worker);
+	for (size_t i = 0; i < keys->len; ++i) {
+		buffer = get_key_buffer(view, keys_at(keys, i));
+		view->slots[i].buffer = buffer;
+		if (buffer) {
+			buffer->used = true;
+			width += buffer->box.width;
+			if (buffer->box.height > height) {
+				height = buffer->box.height;
+			}
+		}
+	}
+	worker_unlock(&state->worker);
+
+	uint32_t surface_width = render_surface_width(&view->renderer,
+			(uint64_t)width * scale / WSK_SCALE_BASE, scale);
+	int32_t x = 0;
+	if (state->config.align_right || state->config.ticker_width) {
+		x = (int32_t)surface_width - (int32_t)width;
+	}
+	for (size_t i = 0; i < keys->len; ++i) {
+		struct wsk_key_slot *slot = &view->slots[i];
+		if (!slot->buffer) {
+			continue;
+		}
+		slot->x = x;
+		x += slot->buffer->box.width;
+		if (slot->x < 0) {
+			// Scrolled out of a ticker
+			slot->buffer = NULL;
+		}
+	}
+
+	uint32_t buffer_width = surface_width * scale / WSK_SCALE_BASE;
+	uint32_t buffer_height = height * scale / WSK_SCALE_BASE;
+	struct pool_buffer *blank = &view->blank;
+	if (width > 0 && (blank->width != buffer_width
+				|| blank->height != buffer_height)) {
+		// Surfaces may go on showing the old one; it is never written to
+		destroy_single_buffer(blank);
+		if (!create_single_buffer(blank, state->shm,
+					buffer_width, buffer_height)) {
+			fprintf(stderr, "Unable to create a buffer: %s\n",
+					strerror(errno));
+		}
+	}
+
+	struct wsk_render_job *job = &view->job;
+	job->frame = (struct wsk_frame){
+		.scale = scale,
+		.surface_width = width > 0 ? surface_width : 0,
+		.surface_height = width > 0 ? height : 0,
+		.width = buffer_width,
+		.height = buffer_height,
+	};
+	job->buffer = blank->buffer ? blank : NULL;
+	job->animating = false;
+	commit_view(view);
+
+	/* Labels neither laid out nor shown any more */
+	struct wsk_key_buffer **link = &view->key_buffers;
+	while (*link) {
+		buffer = *link;
+		if (buffer->used || buffer->refs > 0) {
+			link = &buffer->next;
+			continue;
+		}
+		*link = buffer->next;
+		destroy_single_buffer(&buffer->buffer);
+		free(buffer);
+	}
+}
+
+/* Hands the keys as they are now to the render worker */
+static void render_view(struct wsk_view *view) {
+	struct wsk_seat *seat = view->seat;
+	struct wsk_state *state = seat->state;
+	if (view->job.queued) {
+		// Drawn again once this one is committed
+		view->dirty = true;
+		return;
+	}
+	view->dirty = false;
+	view->render_time = now_usec();
+	/*
+	 * Tag the frame with the newest key event it shows, unless the keys of
+	 * an earlier frame are still waiting for a surface to be configured
+	 */
+	if (state->latency) {
+		if (!view->input_time) {
+			view->input_time = state->input_time;
+		}
+		state->input_time = 0;
+	}
+	if (state->subsurfaces) {
+		layout_view(view);
+		return;
+	}
+
+	struct wsk_render_job *job = &view->job;
+	job->renderer = &view->renderer;
+	job->pool = &view->pool;
+	keys_copy(&job->keys, &seat->keys);
+	job->changed_seq = view->changed_seq;
+	job->unused = view->unused;
+	job->frame = (struct wsk_frame){
+		.scale = view->scale,
+		.time = frame_target_time(state),
+	};
+	job->data = view;
+	view->changed_seq = UINT64_MAX;
+	view->unused = NULL;
+	worker_submit(&state->worker, job);
+}
+
+/* Shows what the render worker drew on the view's surfaces */
+static void commit_view(struct wsk_view *view) {
+	struct wsk_seat *seat = view->seat;
+	struct wsk_state *state = seat->state;
+	struct wsk_render_job *job = &view->job;
+	struct wsk_frame *frame = &job->frame;
+	struct pool_buffer *buffer = job->buffer;
+	uint64_t input_time = view->input_time;
+	int scale = frame->scale;
+	uint32_t width = frame->surface_width, height = frame->surface_height;
+	view->animating = job->animating;
+
+	struct wsk_surface *surface;
+	if (width == 0 || height == 0) {
+		// Unmap; an unmapped surface gets no more frame callbacks
+		view_cancel_frame(view);
+		for (surface = state->surfaces; surface; surface = surface->next) {
+			if (surface->view != view || surface->requested_width == 0) {
+				continue;
+			}
+			surface_clear_keys(surface);
+			wl_surface_attach(surface->surface, NULL, 0, 0);
+			wl_surface_commit(surface->surface);
+			// It needs to be configured again before it is mapped
+			surface->width = surface->height = 0;
+			surface->requested_width = surface->requested_height = 0;
+			surface->configured = false;
+			surface->frame = 0;
+		}
+		view->input_time = 0;
+		return;
+	}
+	++view->frames;
+	if (!buffer) {
+		view->starved = true;
+		return;
+	}
+
+	size_t ready = 0;
+	for (surface = state->surfaces; surface; surface = surface->next) {
+		if (surface->view != view) {
+			continue;
+		} else if (surface->requested_width == width
+				&& surface->requested_height == height) {
+			/*
+			 * Whatever size the compositor settled on, it is not asked
+			 * again until the keys need another one
+			 */
+			ready += surface->configured;
+			continue;
+		}
+		zwlr_layer_surface_v1_set_size(surface->layer_surface, width, height);
+		wl_surface_commit(surface->surface);
+		surface->requested_width = width;
+		surface->requested_height = height;
+		surface->configured = false;
+	}
+	if (ready == 0) {
+		// Drawn again once configured; the worker may reuse the buffer
+		if (!state->subsurfaces) {
+			view->unused = buffer;
+		}
+		return;
+	}
+
+	struct wsk_feedback *wsk_feedback = NULL;
+	for (surface = state->surfaces; surface; surface = surface->next) {
+		if (surface->view != view || !surface->configured
+				|| surface->requested_width != width
+				|| surface->requested_height != height) {
+			continue;
+		}
+		if (surface->viewport) {
+			// Buffers at fractional scales are sized to the surface
+			wp_viewport_set_destination(surface->viewport, width, height);
 		} else {
-			zwlr_layer_surface_v1_set_size(
-					state->layer_surface, width / scale, height / scale);
-		}
-
-		// TODO: this could infinite loop if the compositor assigns us a
-		// different height than what we asked for
-		wl_surface_commit(state->surface);
-	} else if (height > 0) {
-		// Replay recording into shm and send it off
-		state->current_buffer = get_next_buffer(state->shm,
-				state->buffers, state->width * scale, state->height * scale);
-		if (!state->current_buffer) {
-			cairo_surface_destroy(recorder);
-			cairo_destroy(cairo);
-			return;
+			wl_surface_set_buffer_scale(surface->surface,
+					scale / WSK_SCALE_BASE);
 		}
-		cairo_t *shm = state->current_buffer->cairo;
+		wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+		if (surface->frame + 1 == view->frames) {
+			for (size_t i = 0; i < frame->ndamage; ++i) {
+				struct wsk_damage *damage = &frame->damage[i];
+				wl_surface_damage_buffer(surface->surface, damage->x,
+						damage->y, damage->width, damage->height);
+			}
+		} else {
+			// It missed the frame the damage is relative to
+			wl_surface_damage_buffer(surface->surface,
+					0, 0, buffer->width, buffer->height);
+		}
+		surface->frame = view->frames;
 
-		cairo_save(shm);
-		cairo_set_operator(shm, CAIRO_OPERATOR_CLEAR);
-		cairo_paint(shm);
-		cairo_restore(shm);
+		if (!view->frame_scheduled) {
+			view->frame_callback = wl_surface_frame(surface->surface);
+			wl_callback_add_listener(view->frame_callback,
+					&frame_listener, view);
+			view->frame_surface = surface;
+			view->frame_scheduled = true;
 
-		cairo_set_source_surface(shm, recorder, 0.0, 0.0);
-		cairo_paint(shm);
+			if (state->presentation && (view->animating || input_time)) {
+				wsk_feedback = calloc(1, sizeof(struct wsk_feedback));
+			}
+			if (wsk_feedback) {
+				wsk_feedback->state = state;
+				wsk_feedback->input_time = input_time;
+				struct wp_presentation_feedback *feedback =
+					wp_presentation_feedback(state->presentation,
+							surface->surface);
+				wp_presentation_feedback_add_listener(feedback,
+						&feedback_listener, wsk_feedback);
+			}
+		}
+		if (state->subsurfaces) {
+			surface_update_keys(surface);
+		}
+		wl_surface_commit(surface->surface);
+	}
 
-		wl_surface_set_buffer_scale(state->surface, scale);
-		wl_surface_attach(state->surface,
-				state->current_buffer->buffer, 0, 0);
-		wl_surface_damage_buffer(state->surface, 0, 0,
-				state->width, state->height);
-		wl_surface_commit(state->surface);
+	if (input_time) {
+		uint64_t render_time = view->render_time;
+		uint64_t commit_time = now_usec();
+		if (wsk_feedback) {
+			wsk_feedback->commit_time = commit_time;
+		}
+		latency_add(state->latency, WSK_LATENCY_INPUT_RENDER,
+				render_time > input_time ? render_time - input_time : 0);
+		latency_add(state->latency, WSK_LATENCY_RENDER_COMMIT,
+				commit_time - render_time);
+		view->input_time = 0;
 	}
 }
 
-static void set_dirty(struct wsk_state *state) {
-	if (state->frame_scheduled) {
-		state->dirty = true;
-	} else if (state->surface) {
-		render_frame(state);
+static void surface_destroy(struct wsk_surface *surface) {
+	struct wsk_surface **link = &surface->seat->state->surfaces;
+	while (*link != surface) {
+		link = &(*link)->next;
+	}
+	*link = surface->next;
+	surface_clear_keys(surface);
+	free(surface->keys);
+	free(surface->spare);
+	if (surface->view) {
+		if (surface->view->frame_surface == surface) {
+			view_cancel_frame(surface->view);
+		}
+		view_unref(surface->view);
+	}
+	if (surface->viewport) {
+		wp_fractional_scale_v1_destroy(surface->fractional_scale);
+		wp_viewport_destroy(surface->viewport);
 	}
+	zwlr_layer_surface_v1_destroy(surface->layer_surface);
+	wl_surface_destroy(surface->surface);
+	free(surface);
 }
 
 static void layer_surface_configure(void *data,
 			struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1,
 			uint32_t serial, uint32_t width, uint32_t height) {
-	struct wsk_state *state = data;
-	state->width = width;
-	state->height = height;
+	struct wsk_surface *surface = data;
+	surface->width = width;
+	surface->height = height;
+	surface->configured = true;
 	zwlr_layer_surface_v1_ack_configure(zwlr_layer_surface_v1, serial);
-	set_dirty(state);
+	if (surface->view) {
+		surface->view->dirty = true;
+	}
 }
 
 static void layer_surface_closed(void *data,
 		struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1) {
-	struct wsk_state *state = data;
-	state->run = false;
+	struct wsk_surface *surface = data;
+	struct wsk_state *state = surface->seat->state;
+	if (!state->output_name) {
+		state->run = false;
+		return;
+	}
+	// Its output is gone; it is created again if the output comes back
+	surface_destroy(surface);
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -228,12 +1063,13 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 
 static void surface_enter(void *data,
 		struct wl_surface *wl_surface, struct wl_output *output) {
-	struct wsk_state *state = data;
-	struct wsk_output *wsk_output = state->outputs;
-	while (wsk_output->output != output) {
-		wsk_output = wsk_output->next;
+	struct wsk_surface *surface = data;
+	struct wsk_output *wsk_output = wl_output_get_user_data(output);
+	if (!wsk_output || surface->output == wsk_output) {
+		return;
 	}
-	state->output = wsk_output;
+	surface->output = wsk_output;
+	surface_update_view(surface);
 }
 
 static void surface_leave(void *data,
@@ -246,9 +1082,151 @@ static const struct wl_surface_listener wl_surface_listener = {
 	.leave = surface_leave,
 };
 
+static void fractional_scale_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *wp_fractional_scale_v1,
+		uint32_t scale) {
+	struct wsk_surface *surface = data;
+	surface->preferred_scale = scale;
+	surface_update_view(surface);
+}
+
+static const struct wp_fractional_scale_v1_listener
+		fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
+};
+
+/*
+ * Creates a layer surface for seat's keys on output, or where the compositor
+ * likes if NULL
+ */
+static struct wsk_surface *surface_create(struct wsk_seat *seat,
+		struct wsk_output *output) {
+	struct wsk_state *state = seat->state;
+	struct wsk_surface *surface = calloc(1, sizeof(struct wsk_surface));
+	if (surface && state->subsurfaces) {
+		surface->keys = calloc(seat->keys.max, sizeof(struct wsk_key_surface));
+		surface->spare = calloc(seat->keys.max,
+				sizeof(struct wsk_key_surface));
+	}
+	if (!surface || (state->subsurfaces
+				&& (!surface->keys || !surface->spare))) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		if (surface) {
+			free(surface->keys);
+			free(surface->spare);
+		}
+		free(surface);
+		return NULL;
+	}
+	surface->seat = seat;
+	surface->output = output;
+	surface->surface = wl_compositor_create_surface(state->compositor);
+	assert(surface->surface);
+	wl_surface_add_listener(surface->surface, &wl_surface_listener, surface);
+	set_empty_input_region(state, surface->surface);
+	// Keys are put side by side in whole surface pixels with -S
+	if (state->viewporter && state->fractional_scale_mgr
+			&& !state->subsurfaces) {
+		surface->viewport = wp_viewporter_get_viewport(state->viewporter,
+				surface->surface);
+		surface->fractional_scale =
+			wp_fractional_scale_manager_v1_get_fractional_scale(
+					state->fractional_scale_mgr, surface->surface);
+		wp_fractional_scale_v1_add_listener(surface->fractional_scale,
+				&fractional_scale_listener, surface);
+	}
+
+	surface->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+			state->layer_shell, surface->surface,
+			output ? output->output : NULL,
+			ZWLR_LAYER_SHELL_V1_LAYER_TOP, "showkeys");
+	assert(surface->layer_surface);
+	zwlr_layer_surface_v1_add_listener(
+			surface->layer_surface, &layer_surface_listener, surface);
+	zwlr_layer_surface_v1_set_size(surface->layer_surface, 1, 1);
+	surface->requested_width = surface->requested_height = 1;
+	zwlr_layer_surface_v1_set_anchor(surface->layer_surface, state->anchor);
+	zwlr_layer_surface_v1_set_margin(surface->layer_surface, state->margin,
+			state->margin, state->margin, state->margin);
+	zwlr_layer_surface_v1_set_exclusive_zone(surface->layer_surface, -1);
+	wl_surface_commit(surface->surface);
+
+	surface->next = state->surfaces;
+	state->surfaces = surface;
+	surface_update_view(surface);
+	return surface;
+}
+
+/*
+ * Stacks the overlays of the seats after the first above (or below) those
+ * of the seats before them, when they are anchored to the top or bottom.
+ */
+static void update_stacking(struct wsk_state *state) {
+	uint32_t edge = state->anchor & (ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
+			| ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM);
+	if (edge != ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
+			&& edge != ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM) {
+		return;
+	}
+	uint32_t offset = 0;
+	for (struct wsk_seat *seat = state->seats; seat; seat = seat->next) {
+		uint32_t height = 0;
+		struct wsk_surface *surface = state->surfaces;
+		for (; surface; surface = surface->next) {
+			if (surface->seat != seat) {
+				continue;
+			}
+			if (surface->offset != offset) {
+				surface->offset = offset;
+				int margin = state->margin;
+				zwlr_layer_surface_v1_set_margin(surface->layer_surface,
+						edge == ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP ?
+							margin + (int)offset : margin,
+						margin,
+						edge == ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM ?
+							margin + (int)offset : margin,
+						margin);
+				wl_surface_commit(surface->surface);
+			}
+			if (surface->frame && surface->height > height) {
+				height = surface->height;
+			}
+		}
+		offset += height;
+	}
+}
+
+static void set_keymap(struct wsk_seat *seat, struct xkb_keymap *keymap) {
+	struct wsk_state *state = seat->state;
+	if (!keymap) {
+		fprintf(stderr, "Unable to compile keymap\n");
+		return;
+	}
+	struct xkb_state *xkb_state = xkb_state_new(keymap);
+	xkb_keymap_unref(seat->xkb_keymap);
+	xkb_state_unref(seat->xkb_state);
+	seat->xkb_keymap = keymap;
+	seat->xkb_state = xkb_state;
+
+	if (state->recorder.file) {
+		char *text = xkb_keymap_get_as_string(keymap,
+				XKB_KEYMAP_FORMAT_TEXT_V1);
+		if (text) {
+			record_keymap(&state->recorder, now_usec(), text);
+			free(text);
+		}
+	}
+}
+
 static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t format, int32_t fd, uint32_t size) {
-	struct wsk_state *state = data;
+	struct wsk_seat *seat = data;
+	struct wsk_state *state = seat->state;
+	if (state->replay.data) {
+		// Replays use the keymap they were recorded with
+		close(fd);
+		return;
+	}
 	char *map_shm = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
 	if (map_shm == MAP_FAILED) {
 		close(fd);
@@ -266,12 +1244,7 @@ static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 			XKB_KEYMAP_COMPILE_NO_FLAGS);
 	munmap(map_shm, size);
 	close(fd);
-
-	struct xkb_state *xkb_state = xkb_state_new(keymap);
-	xkb_keymap_unref(state->xkb_keymap);
-	xkb_state_unref(state->xkb_state);
-	state->xkb_keymap = keymap;
-	state->xkb_state = xkb_state;
+	set_keymap(seat, keymap);
 }
 
 static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard,
@@ -297,7 +1270,13 @@ static void keyboard_modifiers(void *data, struct wl_keyboard *wl_keyboard,
 
 static void keyboard_repeat_info(void *data, struct wl_keyboard *wl_keyboard,
 		int32_t rate, int32_t delay) {
-	// TODO
+	struct wsk_seat *seat = data;
+	struct wsk_state *state = seat->state;
+	if (state->replay.data) {
+		return;
+	}
+	set_repeat_info(seat, rate, delay);
+	record_repeat_info(&state->recorder, now_usec(), rate, delay);
 }
 
 static const struct wl_keyboard_listener wl_keyboard_listener = {
@@ -309,32 +1288,143 @@ static const struct wl_keyboard_listener wl_keyboard_listener = {
 	.repeat_info = keyboard_repeat_info,
 };
 
-static void seat_capabilities(
-		void *data, struct wl_seat *wl_seat, uint32_t capabilities) {
-	struct wsk_state *state = data;
-	if (state->keyboard) {
-		// TODO: support multiple seats
+static void seat_capabilities(
+		void *data, struct wl_seat *wl_seat, uint32_t capabilities) {
+	struct wsk_seat *seat = data;
+	if (seat->state->replay.data) {
+		// Keyboards on build machines' compositors are not needed
+		return;
+	}
+
+	bool keyboard = capabilities & WL_SEAT_CAPABILITY_KEYBOARD;
+	if (keyboard && !seat->keyboard) {
+		seat->keyboard = wl_seat_get_keyboard(wl_seat);
+		wl_keyboard_add_listener(seat->keyboard, &wl_keyboard_listener, seat);
+	} else if (!keyboard && seat->keyboard) {
+		wl_keyboard_release(seat->keyboard);
+		seat->keyboard = NULL;
+	}
+}
+
+static const struct libinput_interface libinput_impl;
+static void evdev_key(void *data, uint32_t keycode, bool pressed,
+		uint64_t time);
+static void seat_dispatch(void *data);
+
+static void scan_udev_nodes(struct wsk_state *state) {
+	state->udev_scanned = true;
+	struct udev_enumerate *enumerate = udev_enumerate_new(state->udev);
+	if (!enumerate) {
+		return;
+	}
+	udev_enumerate_add_match_subsystem(enumerate, "input");
+	udev_enumerate_add_match_sysname(enumerate, "event*");
+	udev_enumerate_scan_devices(enumerate);
+	struct udev_list_entry *entry;
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *udev_device = udev_device_new_from_syspath(
+				state->udev, udev_list_entry_get_name(entry));
+		if (!udev_device) {
+			continue;
+		}
+		const char *devnode = udev_device_get_devnode(udev_device);
+		const char *seat =
+			udev_device_get_property_value(udev_device, "ID_SEAT");
+		struct wsk_udev_node *node = devnode ?
+			calloc(1, sizeof(struct wsk_udev_node)) : NULL;
+		if (node) {
+			node->devnode = strdup(devnode);
+			node->seat = strdup(seat ? seat : "seat0");
+			node->next = state->udev_nodes;
+			state->udev_nodes = node;
+		}
+		udev_device_unref(udev_device);
+	}
+	udev_enumerate_unref(enumerate);
+}
+
+static void free_udev_nodes(struct wsk_state *state) {
+	while (state->udev_nodes) {
+		struct wsk_udev_node *node = state->udev_nodes;
+		state->udev_nodes = node->next;
+		free(node->devnode);
+		free(node->seat);
+		free(node);
+	}
+}
+
+/*
+ * Requests the event nodes of the udev seat of this name from devmgr, and
+ * returns how many there are
+ */
+static size_t prefetch_seat(struct wsk_state *state, const char *name) {
+	if (!state->udev_scanned) {
+		scan_udev_nodes(state);
+	}
+	size_t count = 0;
+	for (struct wsk_udev_node *node = state->udev_nodes;
+			node; node = node->next) {
+		if (node->devnode && node->seat && strcmp(node->seat, name) == 0) {
+			devmgr_prefetch(&state->devmgr, node->devnode);
+			++count;
+		}
+	}
+	return count;
+}
+
+static void seat_name(void *data, struct wl_seat *wl_seat, const char *name) {
+	struct wsk_seat *seat = data;
+	struct wsk_state *state = seat->state;
+	free(seat->name);
+	seat->name = strdup(name);
+	if (!state->udev || seat->libinput || seat->evdev) {
 		return;
 	}
 
-	if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD)) {
-		fprintf(stderr, "wl_seat does not support keyboard");
-		state->run = false;
+	// devmgr may be busy with a hotplug on another seat
+	input_lock(&state->input);
+	if (state->use_evdev) {
+		seat->evdev = calloc(1, sizeof(struct wsk_evdev));
+		if (!seat->evdev || !evdev_init(seat->evdev, evdev_key, seat)
+				|| !evdev_assign_seat(seat->evdev,
+					state->udev, &state->devmgr, name)
+				|| !input_add_source(&state->input,
+					evdev_get_fd(seat->evdev), seat_dispatch, seat)) {
+			fprintf(stderr, "Failed to read evdev seat %s\n", name);
+			state->run = false;
+		} else if (!seat->evdev->devices) {
+			fprintf(stderr, "No keyboards on udev seat %s; wl_seats get "
+					"the devices of the udev seat (ID_SEAT) of their name\n",
+					name);
+		}
+		input_unlock(&state->input);
 		return;
 	}
 
-	state->keyboard = wl_seat_get_keyboard(wl_seat);
-	wl_keyboard_add_listener(state->keyboard, &wl_keyboard_listener, state);
-}
-
-static void seat_name(void *data, struct wl_seat *wl_seat, const char *name) {
-	struct wsk_state *state = data;
-	/* TODO: support multiple seats */
-	if (libinput_udev_assign_seat(state->libinput, "seat0") != 0) {
-		fprintf(stderr, "Failed to assign libinput seat\n");
+	seat->libinput = libinput_udev_create_context(
+			&libinput_impl, seat, state->udev);
+	if (!seat->libinput) {
+		fprintf(stderr, "libinput_udev_create_context: %s\n",
+				strerror(errno));
 		state->run = false;
+		input_unlock(&state->input);
 		return;
 	}
+	// libinput opens devices one at a time; have them all on the way first
+	if (prefetch_seat(state, name) == 0) {
+		fprintf(stderr, "No input devices on udev seat %s; wl_seats get "
+				"the devices of the udev seat (ID_SEAT) of their name\n",
+				name);
+	}
+	if (libinput_udev_assign_seat(seat->libinput, name) != 0
+			|| !input_add_source(&state->input,
+				libinput_get_fd(seat->libinput), seat_dispatch, seat)) {
+		fprintf(stderr, "Failed to assign libinput seat %s\n", name);
+		state->run = false;
+	}
+	// Those libinput ignored
+	devmgr_discard(&state->devmgr);
+	input_unlock(&state->input);
 }
 
 static const struct wl_seat_listener wl_seat_listener = {
@@ -355,8 +1445,42 @@ static void output_mode(void *data, struct wl_output *wl_output,
 	// Who cares
 }
 
+/*
+ * Called once an output's properties are known or have changed: shows keys
+ * on it if -o asked for it, and moves its surfaces to the right view.
+ */
+static void output_update(struct wsk_output *output) {
+	struct wsk_state *state = output->state;
+	if (!state->run) {
+		// Not set up yet; main does this once it is
+		return;
+	}
+	struct wsk_surface *surface = state->surfaces;
+	for (; surface; surface = surface->next) {
+		if (surface->output == output) {
+			surface_update_view(surface);
+		}
+	}
+	if (!state->output_name || (strcmp(state->output_name, "all") != 0
+				&& (!output->name
+					|| strcmp(state->output_name, output->name) != 0))) {
+		return;
+	}
+	for (struct wsk_seat *seat = state->seats; seat; seat = seat->next) {
+		bool shown = false;
+		for (surface = state->surfaces; surface; surface = surface->next) {
+			if (surface->seat == seat && surface->output == output) {
+				shown = true;
+			}
+		}
+		if (!shown) {
+			surface_create(seat, output);
+		}
+	}
+}
+
 static void output_done(void *data, struct wl_output *wl_output) {
-	// Who cares
+	output_update(data);
 }
 
 static void output_scale(void *data,
@@ -372,25 +1496,205 @@ static const struct wl_output_listener wl_output_listener = {
 	.scale = output_scale,
 };
 
+static void xdg_output_logical_position(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
+	// Who cares
+}
+
+static void xdg_output_logical_size(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
+	// Who cares
+}
+
+static void xdg_output_done(void *data, struct zxdg_output_v1 *xdg_output) {
+	output_update(data);
+}
+
+static void xdg_output_name(void *data,
+		struct zxdg_output_v1 *xdg_output, const char *name) {
+	struct wsk_output *output = data;
+	free(output->name);
+	output->name = strdup(name);
+}
+
+static void xdg_output_description(void *data,
+		struct zxdg_output_v1 *xdg_output, const char *description) {
+	// Who cares
+}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+	.logical_position = xdg_output_logical_position,
+	.logical_size = xdg_output_logical_size,
+	.done = xdg_output_done,
+	.name = xdg_output_name,
+	.description = xdg_output_description,
+};
+
+static void output_get_xdg_output(struct wsk_state *state,
+		struct wsk_output *output) {
+	if (!state->output_mgr || output->xdg_output) {
+		return;
+	}
+	output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+			state->output_mgr, output->output);
+	zxdg_output_v1_add_listener(output->xdg_output,
+			&xdg_output_listener, output);
+}
+
+static void output_destroy(struct wsk_output *output) {
+	struct wsk_state *state = output->state;
+	struct wsk_surface *surface = state->surfaces, *next;
+	for (; surface; surface = next) {
+		next = surface->next;
+		if (surface->output != output) {
+			continue;
+		} else if (state->output_name) {
+			surface_destroy(surface);
+		} else {
+			surface->output = NULL;
+		}
+	}
+
+	struct wsk_output **link = &state->outputs;
+	while (*link != output) {
+		link = &(*link)->next;
+	}
+	*link = output->next;
+	if (output->xdg_output) {
+		zxdg_output_v1_destroy(output->xdg_output);
+	}
+	wl_output_release(output->output);
+	free(output->name);
+	free(output);
+}
+
+/* Shows the seat's keys on the outputs the user asked for */
+static void seat_show(struct wsk_seat *seat) {
+	struct wsk_state *state = seat->state;
+	struct wsk_surface *surface = state->surfaces;
+	for (; surface; surface = surface->next) {
+		if (surface->seat == seat && !state->output_name) {
+			return;
+		}
+	}
+	if (!state->output_name) {
+		surface_create(seat, NULL);
+		return;
+	}
+	for (struct wsk_output *output = state->outputs;
+			output; output = output->next) {
+		output_update(output);
+	}
+}
+
+static void seat_destroy(struct wsk_seat *seat) {
+	struct wsk_state *state = seat->state;
+	struct wsk_surface *surface = state->surfaces, *next;
+	for (; surface; surface = next) {
+		next = surface->next;
+		if (surface->seat == seat) {
+			surface_destroy(surface);
+		}
+	}
+
+	struct wsk_seat **link = &state->seats;
+	while (*link != seat) {
+		link = &(*link)->next;
+	}
+	*link = seat->next;
+	if (seat->libinput || seat->evdev) {
+		input_lock(&state->input);
+		input_remove_source(&state->input, seat);
+		libinput_unref(seat->libinput);
+		if (seat->evdev) {
+			evdev_finish(seat->evdev);
+			free(seat->evdev);
+		}
+		input_unlock(&state->input);
+	}
+	if (seat->keyboard) {
+		wl_keyboard_release(seat->keyboard);
+	}
+	wl_seat_release(seat->seat);
+	xkb_state_unref(seat->xkb_state);
+	xkb_keymap_unref(seat->xkb_keymap);
+	keys_finish(&seat->keys);
+	free(seat->name);
+	free(seat);
+}
+
+static void presentation_clock_id(void *data,
+		struct wp_presentation *wp_presentation, uint32_t clk_id) {
+	struct wsk_state *state = data;
+	state->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
+};
+
 static void registry_global(void *data, struct wl_registry *wl_registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct wsk_state *state = data;
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		state->compositor = wl_registry_bind(wl_registry,
 				name, &wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		state->subcompositor = wl_registry_bind(wl_registry,
+				name, &wl_subcompositor_interface, 1);
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, 1);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
-		state->seat = wl_registry_bind(wl_registry,
+		struct wsk_seat *seat = calloc(1, sizeof(struct wsk_seat));
+		if (!seat || !keys_init(&seat->keys, state->max_keys)) {
+			fprintf(stderr, "calloc: %s\n", strerror(errno));
+			free(seat);
+			return;
+		}
+		seat->state = state;
+		seat->global = name;
+		seat->seat = wl_registry_bind(wl_registry,
 				name, &wl_seat_interface, 5);
+		struct wsk_seat **link = &state->seats;
+		while (*link) {
+			link = &(*link)->next;
+		}
+		*link = seat;
+		wl_seat_add_listener(seat->seat, &wl_seat_listener, seat);
+		if (state->run) {
+			seat_show(seat);
+		}
 	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
-		state->output_mgr = wl_registry_bind(wl_registry,
-				name, &zxdg_output_manager_v1_interface, 1);
+		// Output names came with version 2
+		state->output_mgr = wl_registry_bind(wl_registry, name,
+				&zxdg_output_manager_v1_interface, version < 2 ? version : 2);
+		for (struct wsk_output *output = state->outputs;
+				output; output = output->next) {
+			output_get_xdg_output(state, output);
+		}
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		state->presentation = wl_registry_bind(wl_registry,
+				name, &wp_presentation_interface, 1);
+		wp_presentation_add_listener(state->presentation,
+				&presentation_listener, state);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(wl_registry,
+				name, &wp_viewporter_interface, 1);
+	} else if (strcmp(interface,
+				wp_fractional_scale_manager_v1_interface.name) == 0) {
+		state->fractional_scale_mgr = wl_registry_bind(wl_registry,
+				name, &wp_fractional_scale_manager_v1_interface, 1);
 	} else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
 		state->layer_shell = wl_registry_bind(wl_registry,
 				name, &zwlr_layer_shell_v1_interface, 1);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
 		struct wsk_output *output = calloc(1, sizeof(struct wsk_output));
+		if (!output) {
+			fprintf(stderr, "calloc: %s\n", strerror(errno));
+			return;
+		}
+		output->state = state;
+		output->global = name;
 		output->output = wl_registry_bind(wl_registry,
 				name, &wl_output_interface, 3);
 		output->scale = 1;
@@ -400,12 +1704,27 @@ static void registry_global(void *data, struct wl_registry *wl_registry,
 		}
 		*link = output;
 		wl_output_add_listener(output->output, &wl_output_listener, output);
+		output_get_xdg_output(state, output);
 	}
 }
 
 static void registry_global_remove(void *data,
 		struct wl_registry *wl_registry, uint32_t name) {
-	/* This space deliberately left blank */
+	struct wsk_state *state = data;
+	for (struct wsk_output *output = state->outputs;
+			output; output = output->next) {
+		if (output->global == name) {
+			output_destroy(output);
+			return;
+		}
+	}
+	for (struct wsk_seat *seat = state->seats; seat; seat = seat->next) {
+		if (seat->global == name) {
+			seat_destroy(seat);
+			update_timer(state);
+			return;
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -413,12 +1732,100 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = registry_global_remove,
 };
 
-static void handle_libinput_event(struct wsk_state *state,
-		struct libinput_event *event) {
-	if (!state->xkb_state) {
+/*
+ * Handles a key event from libinput, evdev or a replay; keycode is an evdev
+ * code
+ */
+static void handle_key(struct wsk_seat *seat, uint32_t keycode,
+		enum libinput_key_state key_state, uint64_t time) {
+	struct wsk_state *state = seat->state;
+	if (!seat->xkb_state) {
+		return;
+	}
+	record_key(&state->recorder, time, keycode, key_state);
+
+	keycode += 8;
+	xkb_state_update_key(seat->xkb_state, keycode,
+			key_state == LIBINPUT_KEY_STATE_RELEASED ?
+				XKB_KEY_UP : XKB_KEY_DOWN);
+
+	xkb_keysym_t keysym = xkb_state_key_get_one_sym(seat->xkb_state, keycode);
+
+	struct wsk_keypress *keypress = NULL;
+	switch (key_state) {
+	case LIBINPUT_KEY_STATE_RELEASED:
+		if (seat->held && seat->held_keycode == keycode) {
+			update_held_key(seat, time);
+			seat->held = false;
+		}
 		return;
+	case LIBINPUT_KEY_STATE_PRESSED:
+		// Holding one key and pressing another stops the repeat
+		seat->held = false;
+
+		if (seat->keys.len) {
+			keypress = keys_at(&seat->keys, seat->keys.len - 1);
+		}
+		/*
+		 * Another press of the same special key, e.g. Backspace, counts as
+		 * a repeat when it comes before the first repeat of the last
+		 * press or repeat would have
+		 */
+		if (keypress && keypress->sym == keysym
+				&& keypress->label != KEYSYM_LABEL_CHAR
+				&& keypress->repeat < UINT16_MAX
+				&& seat->repeat_delay > 0 && time >= keypress->time
+				&& time - keypress->time
+					< (uint64_t)seat->repeat_delay * 1000) {
+			++keypress->repeat;
+			keypress->time = time;
+			key_changed(seat, seat->keys.seq + seat->keys.len - 1);
+		} else {
+			keypress = keys_append(&seat->keys);
+			keypress->sym = keysym;
+			keypress->time = time;
+			keypress->repeat = 1;
+			/* Keys which don't type a visible character are special */
+			uint32_t codepoint =
+				xkb_state_key_get_utf32(seat->xkb_state, keycode);
+			if (codepoint > ' ' && codepoint != 0x7F) {
+				keypress->label = KEYSYM_LABEL_CHAR;
+			} else {
+				keypress->label = keysym_label_find(keysym);
+			}
+		}
+
+		if (seat->repeat_rate > 0
+				&& xkb_keymap_key_repeats(seat->xkb_keymap, keycode)) {
+			seat->held = true;
+			seat->held_keycode = keycode;
+			seat->held_seq = seat->keys.seq + seat->keys.len - 1;
+			seat->held_since = time;
+			seat->held_base = keypress->repeat;
+		}
+		if (time > state->input_time) {
+			state->input_time = time;
+		}
+		break;
 	}
 
+	set_dirty(seat);
+}
+
+/* Input thread: hands a key to the main thread, which calls handle_key */
+static void push_key(struct wsk_seat *seat, uint32_t keycode,
+		bool pressed, uint64_t time) {
+	struct wsk_input_key key = {
+		.time = time,
+		.seat = seat->global,
+		.keycode = keycode,
+		.pressed = pressed,
+	};
+	input_push(&seat->state->input, &key);
+}
+
+static void handle_libinput_event(struct wsk_seat *seat,
+		struct libinput_event *event) {
 	enum libinput_event_type event_type = libinput_event_get_type(event);
 	if (event_type != LIBINPUT_EVENT_KEYBOARD_KEY) {
 		return;
@@ -426,49 +1833,139 @@ static void handle_libinput_event(struct wsk_state *state,
 
 	struct libinput_event_keyboard *kbevent =
 		libinput_event_get_keyboard_event(event);
+	push_key(seat, libinput_event_keyboard_get_key(kbevent),
+			libinput_event_keyboard_get_key_state(kbevent)
+				== LIBINPUT_KEY_STATE_PRESSED,
+			libinput_event_keyboard_get_time_usec(kbevent));
+}
 
-	uint32_t keycode = libinput_event_keyboard_get_key(kbevent) + 8;
-	enum libinput_key_state key_state =
-		libinput_event_keyboard_get_key_state(kbevent);
-	xkb_state_update_key(state->xkb_state, keycode,
-			key_state == LIBINPUT_KEY_STATE_RELEASED ?
-				XKB_KEY_UP : XKB_KEY_DOWN);
+static void evdev_key(void *data, uint32_t keycode, bool pressed,
+		uint64_t time) {
+	push_key(data, keycode, pressed, time);
+}
 
-	xkb_keysym_t keysym = xkb_state_key_get_one_sym(state->xkb_state, keycode);
+/* Input thread: reads whatever the seat's devices have */
+static void seat_dispatch(void *data) {
+	struct wsk_seat *seat = data;
+	struct wsk_state *state = seat->state;
+	if (seat->evdev) {
+		if (evdev_dispatch(seat->evdev) != 0) {
+			fprintf(stderr, "evdev_dispatch: %s\n", strerror(errno));
+			input_remove_source(&state->input, seat);
+		}
+		return;
+	}
+	if (libinput_dispatch(seat->libinput) != 0) {
+		fprintf(stderr, "libinput_dispatch: %s\n", strerror(errno));
+		input_remove_source(&state->input, seat);
+		return;
+	}
+	struct libinput_event *event;
+	while ((event = libinput_get_event(seat->libinput))) {
+		handle_libinput_event(seat, event);
+		libinput_event_destroy(event);
+	}
+}
 
-	struct wsk_keypress *keypress;
-	switch (key_state) {
-	case LIBINPUT_KEY_STATE_RELEASED:
-		/* Who cares */
-		break;
-	case LIBINPUT_KEY_STATE_PRESSED:
-		keypress = calloc(1, sizeof(struct wsk_keypress));
-		assert(keypress);
-		keypress->sym = keysym;
-		xkb_keysym_get_name(keypress->sym, keypress->name,
-				sizeof(keypress->name));
-		if (xkb_state_key_get_utf8(state->xkb_state, keycode,
-				keypress->utf8, sizeof(keypress->utf8)) <= 0 ||
-				keypress->utf8[0] <= ' ') {
-			keypress->utf8[0] = '\0';
-		}
-
-		struct wsk_keypress **link = &state->keys;
-		while (*link) {
-			link = &(*link)->next;
+/* Main thread: feeds the keys read by the input thread to handle_key */
+static void drain_input(struct wsk_state *state) {
+	uint64_t count;
+	if (read(input_get_fd(&state->input), &count, sizeof(count)) < 0
+			&& errno != EAGAIN) {
+		fprintf(stderr, "eventfd read: %s\n", strerror(errno));
+	}
+	struct wsk_input_key key;
+	struct wsk_seat *seat = NULL;
+	while (input_pop(&state->input, &key)) {
+		if (!seat || seat->global != key.seat) {
+			seat = state->seats;
+			while (seat && seat->global != key.seat) {
+				seat = seat->next;
+			}
 		}
-		*link = keypress;
-		break;
+		if (seat) {
+			handle_key(seat, key.keycode, key.pressed ?
+					LIBINPUT_KEY_STATE_PRESSED : LIBINPUT_KEY_STATE_RELEASED,
+					key.time);
+		}
+	}
+	record_flush(&state->recorder);
+	update_timer(state);
+}
+
+/* Arms replay_fd for the next record, unless replaying as fast as possible */
+static void replay_schedule(struct wsk_state *state) {
+	const struct wsk_record *record = replay_peek(&state->replay);
+	if (!record || state->replay_fast) {
+		return;
+	}
+	uint64_t deadline = state->replay_base + record->time;
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = deadline / 1000000,
+			.tv_nsec = deadline % 1000000 * 1000,
+		},
+	};
+	if (deadline == 0) {
+		// A zero it_value would disarm the timer
+		spec.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(state->replay_fd, TFD_TIMER_ABSTIME,
+				&spec, NULL) != 0) {
+		fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
 	}
+}
+
+/*
+ * Feeds the records which are due to the same code live input goes through.
+ * As fast as possible means one record each time around the main loop.
+ */
+static void replay_dispatch(struct wsk_state *state) {
+	struct wsk_seat *seat = state->seats;
+	uint64_t now = now_usec();
+	const struct wsk_record *record;
+	while (seat && (record = replay_peek(&state->replay))) {
+		uint64_t time = state->replay_base + record->time;
+		if (state->replay_fast) {
+			time = now;
+		} else if (time > now) {
+			break;
+		}
 
-	clock_gettime(CLOCK_MONOTONIC, &state->last_key);
-	set_dirty(state);
+		switch (record->type) {
+		case WSK_RECORD_KEY:
+			if (!seat->xkb_state) {
+				// Recorded before the compositor sent a keymap
+				struct xkb_rule_names names = { 0 };
+				set_keymap(seat, xkb_keymap_new_from_names(
+						state->xkb_context, &names,
+						XKB_KEYMAP_COMPILE_NO_FLAGS));
+			}
+			handle_key(seat, record->value, record->state, time);
+			break;
+		case WSK_RECORD_KEYMAP:
+			set_keymap(seat, xkb_keymap_new_from_buffer(
+					state->xkb_context, (const char *)(record + 1),
+					record->value, XKB_KEYMAP_FORMAT_TEXT_V1,
+					XKB_KEYMAP_COMPILE_NO_FLAGS));
+			break;
+		case WSK_RECORD_REPEAT:
+			set_repeat_info(seat, record->value, record->state);
+			break;
+		}
+		replay_advance(&state->replay);
+		if (state->replay_fast && record->type == WSK_RECORD_KEY) {
+			break;
+		}
+	}
+	replay_schedule(state);
+	update_timer(state);
 }
 
 static int libinput_open_restricted(const char *path,
 		int flags, void *data) {
-	int *fd = data;
-	return devmgr_open(*fd, path);
+	struct wsk_seat *seat = data;
+	return devmgr_open(&seat->state->devmgr, path);
 }
 
 static void libinput_close_restricted(int fd, void *data) {
@@ -501,80 +1998,205 @@ static uint32_t parse_color(const char *color) {
 int main(int argc, char *argv[]) {
 	/* NOTICE: This code runs as root */
 	struct wsk_state state = { 0 };
-	if (devmgr_start(&state.devmgr, &state.devmgr_pid, INPUTDEVPATH) > 0) {
-		return 1;
-	}
-
-	/* Begin normal user code: */
 	int ret = 0;
 
-	unsigned int anchor = 0;
-	int margin = 32;
-	state.background = 0x000000CC;
-	state.specialfg = 0xAAAAAAFF;
-	state.foreground = 0xFFFFFFFF;
-	state.font = "monospace 24";
-	state.timeout = 1;
-
+	state.margin = 32;
+	state.config.background = 0x000000CC;
+	state.config.specialfg = 0xAAAAAAFF;
+	state.config.foreground = 0xFFFFFFFF;
+	state.config.font = "monospace 24";
+	state.config.timeout = 1000000;
+	state.max_keys = 32;
+	state.nbuffers = 3;
+
+	const char *record_path = NULL, *replay_path = NULL;
+
+	static const struct option long_options[] = {
+		{ "record", required_argument, NULL, 'r' },
+		{ "replay", required_argument, NULL, 'R' },
+		{ "fast", no_argument, NULL, 'x' },
+		{ "input", required_argument, NULL, 'I' },
+		{ "ticker", required_argument, NULL, 'w' },
+		{ "subsurfaces", no_argument, NULL, 'S' },
+		{ 0 },
+	};
+	bool latency = false;
 	int c;
-	while ((c = getopt(argc, argv, "hb:f:s:F:t:a:m:o:")) != -1) {
+	while ((c = getopt_long(argc, argv, "hb:f:s:F:t:n:p:A:a:m:o:r:R:xLI:w:S",
+					long_options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			state.background = parse_color(optarg);
+			state.config.background = parse_color(optarg);
 			break;
 		case 'f':
-			state.foreground = parse_color(optarg);
+			state.config.foreground = parse_color(optarg);
 			break;
 		case 's':
-			state.specialfg = parse_color(optarg);
+			state.config.specialfg = parse_color(optarg);
 			break;
 		case 'F':
-			state.font = optarg;
+			state.config.font = optarg;
 			break;
 		case 't':
-			state.timeout = atoi(optarg);
+			state.config.timeout = strtod(optarg, NULL) * 1000000;
+			break;
+		case 'n':
+			state.max_keys = strtoul(optarg, NULL, 10);
+			if (state.max_keys == 0) {
+				fprintf(stderr, "max keys must be at least 1\n");
+				return 1;
+			}
+			break;
+		case 'p':
+			state.nbuffers = strtoul(optarg, NULL, 10);
+			if (state.nbuffers < 1 || state.nbuffers > WSK_MAX_BUFFERS) {
+				fprintf(stderr, "buffers must be between 1 and %d\n",
+						WSK_MAX_BUFFERS);
+				return 1;
+			}
+			break;
+		case 'A':
+			if (strcmp(optarg, "fade") == 0) {
+				state.config.animation = WSK_ANIMATION_FADE;
+			} else if (strcmp(optarg, "slide") == 0) {
+				state.config.animation = WSK_ANIMATION_SLIDE;
+			} else if (strcmp(optarg, "none") == 0) {
+				state.config.animation = WSK_ANIMATION_NONE;
+			} else {
+				fprintf(stderr, "Unknown animation %s\n", optarg);
+				return 1;
+			}
 			break;
 		case 'a':
 			if (strcmp(optarg, "top") == 0) {
-				anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
+				state.anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
 			} else if (strcmp(optarg, "left") == 0) {
-				anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
+				state.anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
 			} else if (strcmp(optarg, "right") == 0) {
-				anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+				state.anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
 			} else if (strcmp(optarg, "bottom") == 0) {
-				anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
+				state.anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
 			}
 			break;
 		case 'm':
-			margin = atoi(optarg);
+			state.margin = atoi(optarg);
+			break;
+		case 'w':
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "Invalid ticker width %s\n", optarg);
+				return 1;
+			}
+			state.config.ticker_width = atoi(optarg);
+			break;
+		case 'S':
+			state.subsurfaces = true;
 			break;
 		case 'o':
-			fprintf(stderr, "-o is unimplemented\n");
-			return 0;
+			state.output_name = optarg;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'x':
+			state.replay_fast = true;
+			break;
+		case 'L':
+			latency = true;
+			break;
+		case 'I':
+			if (strcmp(optarg, "evdev") == 0) {
+				state.use_evdev = true;
+			} else if (strcmp(optarg, "libinput") != 0) {
+				fprintf(stderr, "Invalid input backend %s\n", optarg);
+				return 1;
+			}
+			break;
 		default:
 			fprintf(stderr, "usage: wshowkeys [-b|-f|-s #RRGGBB[AA]] [-F font] "
-					"[-t timeout]\n\t[-a top|left|right|bottom] [-m margin] "
-					"[-o output]\n");
+					"[-t timeout] [-n max keys]\n\t[-p buffers] "
+					"[-A none|fade|slide] [-a top|left|right|bottom] "
+					"[-m margin]\n\t[-o output] [-r file] [-R file [-x]] [-L] "
+					"[-I libinput|evdev] [-w width] [-S]\n");
 			return 1;
 		}
 	}
+	if (state.subsurfaces
+			&& state.config.animation != WSK_ANIMATION_NONE) {
+		fprintf(stderr, "Keys can't be animated out with -S\n");
+		return 1;
+	}
+	state.config.align_right = (state.anchor
+			& (ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
+				| ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT))
+		== ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+
+	// Replays need neither input devices nor root
+	if (replay_path ? devmgr_drop_root() != 0
+			: devmgr_start(&state.devmgr, INPUTDEVPATH) != 0) {
+		return 1;
+	}
 
-	state.udev = udev_new();
-	if (!state.udev) {
-		fprintf(stderr, "udev_create: %s\n", strerror(errno));
+	/* Begin normal user code: */
+	if (latency) {
+		state.latency = calloc(1, sizeof(struct wsk_latency));
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR1);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		if (!state.latency || sigprocmask(SIG_BLOCK, &mask, NULL) != 0
+				|| (state.signal_fd = signalfd(-1, &mask,
+						SFD_CLOEXEC | SFD_NONBLOCK)) < 0) {
+			fprintf(stderr, "Unable to set up latency stats: %s\n",
+					strerror(errno));
+			ret = 1;
+			goto exit;
+		}
+	}
+	if (record_path && !record_open(&state.recorder, record_path)) {
 		ret = 1;
 		goto exit;
 	}
+	if (replay_path) {
+		if (!replay_open(&state.replay, replay_path)) {
+			ret = 1;
+			goto exit;
+		}
+		state.replay_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_CLOEXEC | TFD_NONBLOCK);
+		if (state.replay_fd < 0) {
+			fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+			ret = 1;
+			goto exit;
+		}
+	}
 
-	state.libinput = libinput_udev_create_context(
-			&libinput_impl, &state.devmgr, state.udev);
-	udev_unref(state.udev);
-	if (!state.libinput) {
-		fprintf(stderr, "libinput_udev_create_context: %s\n", strerror(errno));
+	keysym_labels_init();
+	state.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_CLOEXEC | TFD_NONBLOCK);
+	if (state.timer_fd < 0) {
+		fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
 		ret = 1;
 		goto exit;
 	}
 
+	if (!replay_path) {
+		// Shared by the input backends of all seats
+		state.udev = udev_new();
+		if (!state.udev) {
+			fprintf(stderr, "udev_create: %s\n", strerror(errno));
+			ret = 1;
+			goto exit;
+		}
+		if (!input_start(&state.input)) {
+			ret = 1;
+			goto exit;
+		}
+	}
+
 	state.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	if (!state.xkb_context) {
 		fprintf(stderr, "xkb_context_new: %s\n", strerror(errno));
@@ -600,10 +2222,11 @@ int main(int argc, char *argv[]) {
 	} need_globals[] = {
 		"wl_compositor", &state.compositor,
 		"wl_shm", &state.shm,
-		"wl_seat", &state.seat,
+		"wl_seat", &state.seats,
 		"wlr_layer_shell", &state.layer_shell,
 	};
-	for (size_t i = 0; i < sizeof(need_globals) / sizeof(need_globals[0]); ++i) {
+	for (size_t i = 0;
+			i < sizeof(need_globals) / sizeof(need_globals[0]); ++i) {
 		if (!need_globals[i].ptr) {
 			fprintf(stderr, "Error: required Wayland interface '%s' "
 					"is not present\n", need_globals[i].name);
@@ -612,35 +2235,66 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	// TODO: Listener for xdg output
+	if (state.output_name && strcmp(state.output_name, "all") != 0
+			&& !state.output_mgr) {
+		fprintf(stderr, "Error: -o needs a compositor supporting "
+				"xdg_output_manager_v1\n");
+		ret = 1;
+		goto exit;
+	}
+	if (state.subsurfaces && !state.subcompositor) {
+		fprintf(stderr, "Error: -S needs a compositor supporting "
+				"wl_subcompositor\n");
+		ret = 1;
+		goto exit;
+	}
+
+	if (!worker_start(&state.worker, state.display, state.shm)) {
+		ret = 1;
+		goto exit;
+	}
 
-	wl_seat_add_listener(state.seat, &wl_seat_listener, &state);
+	state.run = true;
 	wl_display_roundtrip(state.display);
-	
-	state.surface = wl_compositor_create_surface(state.compositor);
-	assert(state.surface);
-	wl_surface_add_listener(state.surface, &wl_surface_listener, &state);
+	for (struct wsk_seat *seat = state.seats; seat; seat = seat->next) {
+		seat_show(seat);
+	}
 
-	state.layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-			state.layer_shell, state.surface, NULL,
-			ZWLR_LAYER_SHELL_V1_LAYER_TOP, "showkeys");
-	assert(state.layer_surface);
-	zwlr_layer_surface_v1_add_listener(
-			state.layer_surface, &layer_surface_listener, &state);
-	zwlr_layer_surface_v1_set_size(state.layer_surface, 1, 1);
-	zwlr_layer_surface_v1_set_anchor(state.layer_surface, anchor);
-	zwlr_layer_surface_v1_set_margin(state.layer_surface,
-			margin, margin, margin, margin);
-	zwlr_layer_surface_v1_set_exclusive_zone(state.layer_surface, -1);
-	wl_surface_commit(state.surface);
-
-	struct pollfd pollfds[] = {
-		{ .fd = libinput_get_fd(state.libinput), .events = POLLIN, },
-		{ .fd = wl_display_get_fd(state.display), .events = POLLIN, },
-	};
+	if (replay_path) {
+		const struct wsk_record *first = replay_peek(&state.replay);
+		if (first) {
+			state.replay_base = now_usec() - first->time;
+		}
+		replay_schedule(&state);
+	}
 
-	state.run = true;
 	while (state.run) {
+		for (struct wsk_seat *seat = state.seats; seat; seat = seat->next) {
+			for (struct wsk_view *view = seat->views;
+					view; view = view->next) {
+				if (view->dirty && !view->frame_scheduled) {
+					render_view(view);
+				}
+			}
+		}
+		update_stacking(&state);
+
+		struct pollfd pollfds[6];
+		pollfds[0] = (struct pollfd){
+			.fd = wl_display_get_fd(state.display), .events = POLLIN };
+		pollfds[1] = (struct pollfd){
+			.fd = state.timer_fd, .events = POLLIN };
+		pollfds[2] = (struct pollfd){
+			.fd = replay_path ? state.replay_fd : -1, .events = POLLIN };
+		pollfds[3] = (struct pollfd){
+			.fd = state.latency ? state.signal_fd : -1, .events = POLLIN };
+		pollfds[4] = (struct pollfd){
+			.fd = state.udev ? input_get_fd(&state.input) : -1,
+			.events = POLLIN,
+		};
+		pollfds[5] = (struct pollfd){
+			.fd = worker_get_fd(&state.worker), .events = POLLIN };
+
 		errno = 0;
 		do {
 			if (wl_display_flush(state.display) == -1 && errno != EAGAIN) {
@@ -650,52 +2304,129 @@ int main(int argc, char *argv[]) {
 		} while (errno == EAGAIN);
 
 		int timeout = -1;
-		if (state.keys) {
-			timeout = 100;
+		if (state.replay_fast && replay_peek(&state.replay)) {
+			timeout = 0;
 		}
-
-		if (poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), timeout) < 0) {
+		if (poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]),
+					timeout) < 0) {
 			fprintf(stderr, "poll: %s\n", strerror(errno));
 			break;
 		}
 
 		/* Clear out old keys */
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		if (now.tv_sec >= state.last_key.tv_sec + state.timeout &&
-				now.tv_nsec >= state.last_key.tv_nsec) {
-			struct wsk_keypress *key = state.keys;
-			while (key) {
-				struct wsk_keypress *next = key->next;
-				free(key);
-				key = next;
+		if ((pollfds[1].revents & POLLIN)) {
+			uint64_t expirations;
+			if (read(state.timer_fd, &expirations,
+						sizeof(expirations)) < 0 && errno != EAGAIN) {
+				fprintf(stderr, "timerfd read: %s\n", strerror(errno));
+				break;
 			}
-			state.keys = NULL;
-			set_dirty(&state);
+			// The timer is one-shot; make sure it gets re-armed
+			state.timer_deadline = 0;
+			uint64_t now = now_usec();
+			for (struct wsk_seat *seat = state.seats;
+					seat; seat = seat->next) {
+				update_held_key(seat, now);
+				expire_keys(seat);
+			}
+			update_timer(&state);
 		}
 
-		if ((pollfds[0].revents & POLLIN)) {
-			if (libinput_dispatch(state.libinput) != 0) {
-				fprintf(stderr, "libinput_dispatch: %s\n", strerror(errno));
+		if ((pollfds[4].revents & POLLIN)) {
+			drain_input(&state);
+		}
+
+		if ((pollfds[2].revents & POLLIN)) {
+			uint64_t expirations;
+			if (read(state.replay_fd, &expirations,
+						sizeof(expirations)) < 0 && errno != EAGAIN) {
+				fprintf(stderr, "timerfd read: %s\n", strerror(errno));
 				break;
 			}
-			struct libinput_event *event;
-			while ((event = libinput_get_event(state.libinput))) {
-				handle_libinput_event(&state, event);
-				libinput_event_destroy(event);
+			replay_dispatch(&state);
+		} else if (state.replay_fast) {
+			replay_dispatch(&state);
+		}
+		if (replay_path) {
+			if (!replay_peek(&state.replay)
+					&& (!state.seats || state.seats->keys.len == 0)) {
+				// Done once the last key has gone
+				state.run = false;
 			}
 		}
 
-		if ((pollfds[1].revents & POLLIN)
-				&& wl_display_dispatch(state.display) == -1) {
-			fprintf(stderr, "wl_display_dispatch: %s\n", strerror(errno));
-			break;
+		if ((pollfds[3].revents & POLLIN)) {
+			struct signalfd_siginfo info;
+			while (read(state.signal_fd, &info, sizeof(info)) > 0) {
+				if (info.ssi_signo == SIGUSR1) {
+					latency_dump(state.latency, stderr);
+				} else {
+					state.run = false;
+				}
+			}
+		}
+
+		if ((pollfds[5].revents & POLLIN)) {
+			struct wsk_render_job *job;
+			while ((job = worker_collect(&state.worker))) {
+				commit_view(job->data);
+			}
+		}
+
+		if ((pollfds[0].revents & POLLIN)) {
+			if (wl_display_dispatch(state.display) == -1) {
+				fprintf(stderr, "wl_display_dispatch: %s\n",
+						strerror(errno));
+				break;
+			}
+			// A buffer may have been released since
+			for (struct wsk_seat *seat = state.seats;
+					seat; seat = seat->next) {
+				for (struct wsk_view *view = seat->views;
+						view; view = view->next) {
+					if (view->starved) {
+						view->starved = false;
+						view->dirty = true;
+					}
+				}
+			}
 		}
 	}
 
 exit:
+	while (state.seats) {
+		seat_destroy(state.seats);
+	}
+	while (state.outputs) {
+		output_destroy(state.outputs);
+	}
+	if (state.udev) {
+		input_finish(&state.input);
+	}
+	if (state.worker.display) {
+		worker_finish(&state.worker);
+	}
+	label_cache_finish(&state.labels);
+	if (state.timer_fd > 0) {
+		close(state.timer_fd);
+	}
+	if (state.replay_fd > 0) {
+		close(state.replay_fd);
+	}
+	if (state.latency) {
+		latency_dump(state.latency, stderr);
+		free(state.latency);
+	}
+	if (state.signal_fd > 0) {
+		close(state.signal_fd);
+	}
+	record_close(&state.recorder);
+	replay_close(&state.replay);
 	wl_display_disconnect(state.display);
-	libinput_unref(state.libinput);
-	devmgr_finish(state.devmgr, state.devmgr_pid);
+	free_udev_nodes(&state);
+	udev_unref(state.udev);
+	if (state.devmgr.pid) {
+		devmgr_finish(&state.devmgr);
+	}
 	return ret;
 }
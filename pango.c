@@ -1,77 +1,231 @@
 #include <cairo/cairo.h>
 #include <pango/pangocairo.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "cairo.h"
+#include "pango.h"
 
-PangoLayout *get_pango_layout(cairo_t *cairo, const char *font,
-		const char *text, double scale) {
-	PangoLayout *layout = pango_cairo_create_layout(cairo);
+void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
+	cairo_set_source_rgba(cairo,
+			(color >> (3*8) & 0xFF) / 255.0,
+			(color >> (2*8) & 0xFF) / 255.0,
+			(color >> (1*8) & 0xFF) / 255.0,
+			(color >> (0*8) & 0xFF) / 255.0);
+}
+
+static uint32_t label_hash(const char *text, double scale,
+		cairo_subpixel_order_t subpixel, uint32_t color) {
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	for (const char *p = text; *p; ++p) {
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	hash = (hash ^ (uint32_t)(scale * 64)) * 16777619u;
+	hash = (hash ^ (uint32_t)subpixel) * 16777619u;
+	hash = (hash ^ color) * 16777619u;
+	return hash;
+}
+
+static void label_destroy(struct wsk_label *label) {
+	if (label->surface) {
+		cairo_surface_destroy(label->surface);
+	}
+	free(label->text);
+	free(label);
+}
+
+static bool label_cache_set_font(struct wsk_label_cache *cache,
+		const char *font) {
+	if (cache->font && strcmp(cache->font, font) == 0) {
+		return true;
+	}
+	label_cache_clear(cache);
+	if (cache->desc) {
+		pango_font_description_free(cache->desc);
+	}
+	free(cache->font);
+	cache->font = strdup(font);
+	cache->desc = pango_font_description_from_string(font);
+	if (!cache->scratch) {
+		/* Only used to give Pango a cairo context to shape against */
+		cache->scratch_surface = cairo_image_surface_create(
+				CAIRO_FORMAT_ARGB32, 1, 1);
+		cache->scratch = cairo_create(cache->scratch_surface);
+		cache->layout = pango_cairo_create_layout(cache->scratch);
+		pango_layout_set_single_paragraph_mode(cache->layout, 1);
+	}
+	if (cache->desc) {
+		pango_layout_set_font_description(cache->layout, cache->desc);
+	}
+	return cache->font && cache->desc;
+}
+
+static cairo_font_options_t *label_cache_options(
+		struct wsk_label_cache *cache, cairo_subpixel_order_t subpixel) {
+	cairo_font_options_t **fo = &cache->options[subpixel];
+	if (!*fo) {
+		*fo = cairo_font_options_create();
+		cairo_font_options_set_hint_style(*fo, CAIRO_HINT_STYLE_FULL);
+		cairo_font_options_set_antialias(*fo, CAIRO_ANTIALIAS_SUBPIXEL);
+		cairo_font_options_set_subpixel_order(*fo, subpixel);
+	}
+	return *fo;
+}
+
+static struct wsk_label *label_create(struct wsk_label_cache *cache,
+		const char *text, double scale, cairo_subpixel_order_t subpixel,
+		uint32_t color) {
+	struct wsk_label *label = calloc(1, sizeof(struct wsk_label));
+	if (!label) {
+		return NULL;
+	}
+	label->text = strdup(text);
+	label->scale = scale;
+	label->subpixel = subpixel;
+	label->color = color;
+	if (!label->text) {
+		free(label);
+		return NULL;
+	}
+
+	cairo_font_options_t *fo = label_cache_options(cache, subpixel);
+	cairo_set_font_options(cache->scratch, fo);
+
+	/* The layout and font options are kept for the next label */
+	PangoLayout *layout = cache->layout;
 	PangoAttrList *attrs = pango_attr_list_new();
 	pango_layout_set_text(layout, text, -1);
 	pango_attr_list_insert(attrs, pango_attr_scale_new(scale));
-	PangoFontDescription *desc = pango_font_description_from_string(font);
-	pango_layout_set_font_description(layout, desc);
-	pango_layout_set_single_paragraph_mode(layout, 1);
 	pango_layout_set_attributes(layout, attrs);
 	pango_attr_list_unref(attrs);
-	pango_font_description_free(desc);
-	return layout;
+	pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
+	pango_cairo_update_layout(cache->scratch, layout);
+	pango_layout_get_pixel_size(layout, &label->width, &label->height);
+	label->baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
+
+	label->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			label->width, label->height);
+	if (cairo_surface_status(label->surface) != CAIRO_STATUS_SUCCESS) {
+		label_destroy(label);
+		return NULL;
+	}
+	cairo_t *cairo = cairo_create(label->surface);
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+	cairo_set_font_options(cairo, fo);
+	cairo_set_source_u32(cairo, color);
+	pango_cairo_update_layout(cairo, layout);
+	pango_cairo_show_layout(cairo, layout);
+	cairo_destroy(cairo);
+	cairo_surface_flush(label->surface);
+	return label;
 }
 
-void get_text_size(cairo_t *cairo, const char *font, int *width, int *height,
-		int *baseline, double scale, const char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	// Add one since vsnprintf excludes null terminator.
-	int length = vsnprintf(NULL, 0, fmt, args) + 1;
-	va_end(args);
+static void lru_unlink(struct wsk_label_cache *cache,
+		struct wsk_label *label) {
+	if (label->lru_prev) {
+		label->lru_prev->lru_next = label->lru_next;
+	} else {
+		cache->lru_first = label->lru_next;
+	}
+	if (label->lru_next) {
+		label->lru_next->lru_prev = label->lru_prev;
+	} else {
+		cache->lru_last = label->lru_prev;
+	}
+	label->lru_prev = label->lru_next = NULL;
+}
 
-	char *buf = malloc(length);
-	if (buf == NULL) {
-		return;
+static void lru_push(struct wsk_label_cache *cache, struct wsk_label *label) {
+	label->lru_next = cache->lru_first;
+	if (cache->lru_first) {
+		cache->lru_first->lru_prev = label;
+	} else {
+		cache->lru_last = label;
 	}
-	va_start(args, fmt);
-	vsnprintf(buf, length, fmt, args);
-	va_end(args);
+	cache->lru_first = label;
+}
 
-	PangoLayout *layout = get_pango_layout(cairo, font, buf, scale);
-	pango_cairo_update_layout(cairo, layout);
-	pango_layout_get_pixel_size(layout, width, height);
-	if (baseline) {
-		*baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
+/* Drops the least recently used label */
+static void label_cache_evict(struct wsk_label_cache *cache) {
+	struct wsk_label *label = cache->lru_last;
+	lru_unlink(cache, label);
+	struct wsk_label **link = &cache->buckets[label->hash % WSK_LABEL_BUCKETS];
+	while (*link != label) {
+		link = &(*link)->next;
 	}
-	g_object_unref(layout);
-	free(buf);
+	*link = label->next;
+	label_destroy(label);
+	--cache->count;
 }
 
-void pango_printf(cairo_t *cairo, const char *font, double scale,
-		const char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	// Add one since vsnprintf excludes null terminator.
-	int length = vsnprintf(NULL, 0, fmt, args) + 1;
-	va_end(args);
-
-	char *buf = malloc(length);
-	if (buf == NULL) {
-		return;
-	}
-	va_start(args, fmt);
-	vsnprintf(buf, length, fmt, args);
-	va_end(args);
-
-	PangoLayout *layout = get_pango_layout(cairo, font, buf, scale);
-	cairo_font_options_t *fo = cairo_font_options_create();
-	cairo_get_font_options(cairo, fo);
-	pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
-	cairo_font_options_destroy(fo);
-	pango_cairo_update_layout(cairo, layout);
-	pango_cairo_show_layout(cairo, layout);
-	g_object_unref(layout);
-	free(buf);
+struct wsk_label *label_cache_get(struct wsk_label_cache *cache,
+		const char *font, const char *text, double scale,
+		cairo_subpixel_order_t subpixel, uint32_t color) {
+	if (!label_cache_set_font(cache, font)) {
+		return NULL;
+	}
+
+	uint32_t hash = label_hash(text, scale, subpixel, color);
+	struct wsk_label **bucket = &cache->buckets[hash % WSK_LABEL_BUCKETS];
+	for (struct wsk_label *label = *bucket; label; label = label->next) {
+		if (label->hash == hash && label->scale == scale
+				&& label->subpixel == subpixel && label->color == color
+				&& strcmp(label->text, text) == 0) {
+			if (label != cache->lru_first) {
+				lru_unlink(cache, label);
+				lru_push(cache, label);
+			}
+			return label;
+		}
+	}
+
+	while (cache->count >= WSK_LABEL_CACHE_MAX) {
+		label_cache_evict(cache);
+	}
+
+	struct wsk_label *label = label_create(
+			cache, text, scale, subpixel, color);
+	if (!label) {
+		return NULL;
+	}
+	label->hash = hash;
+	label->next = *bucket;
+	*bucket = label;
+	lru_push(cache, label);
+	++cache->count;
+	return label;
+}
+
+void label_cache_clear(struct wsk_label_cache *cache) {
+	for (size_t i = 0; i < WSK_LABEL_BUCKETS; ++i) {
+		struct wsk_label *label = cache->buckets[i];
+		while (label) {
+			struct wsk_label *next = label->next;
+			label_destroy(label);
+			label = next;
+		}
+		cache->buckets[i] = NULL;
+	}
+	cache->lru_first = cache->lru_last = NULL;
+	cache->count = 0;
+}
+
+void label_cache_finish(struct wsk_label_cache *cache) {
+	label_cache_clear(cache);
+	if (cache->scratch) {
+		g_object_unref(cache->layout);
+		cairo_destroy(cache->scratch);
+		cairo_surface_destroy(cache->scratch_surface);
+	}
+	for (size_t i = 0; i < WSK_LABEL_SUBPIXEL_ORDERS; ++i) {
+		if (cache->options[i]) {
+			cairo_font_options_destroy(cache->options[i]);
+		}
+	}
+	if (cache->desc) {
+		pango_font_description_free(cache->desc);
+	}
+	free(cache->font);
+	memset(cache, 0, sizeof(struct wsk_label_cache));
 }
@@ -1,16 +1,58 @@
 #ifndef _WSK_PANGO_H
 #define _WSK_PANGO_H
-#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <cairo/cairo.h>
 #include <pango/pangocairo.h>
 
-PangoLayout *get_pango_layout(cairo_t *cairo, const char *font,
-		const char *text, double scale);
-void get_text_size(cairo_t *cairo, const char *font, int *width, int *height,
-		int *baseline, double scale, const char *fmt, ...);
-void pango_printf(cairo_t *cairo, const char *font,
-		double scale, const char *fmt, ...);
+#define WSK_LABEL_BUCKETS 64
+#define WSK_LABEL_CACHE_MAX 256
+/* CAIRO_SUBPIXEL_ORDER_DEFAULT to CAIRO_SUBPIXEL_ORDER_VBGR */
+#define WSK_LABEL_SUBPIXEL_ORDERS 5
+
+/*
+ * A rasterized key label. The surface holds the text in its color on a
+ * transparent background, at the pixel size given by width and height.
+ */
+struct wsk_label {
+	char *text;
+	double scale;
+	uint32_t color;
+	cairo_subpixel_order_t subpixel;
+	uint32_t hash;
+	int width, height, baseline;
+	cairo_surface_t *surface;
+	struct wsk_label *next;
+	/* Least recently used last */
+	struct wsk_label *lru_prev, *lru_next;
+};
+
+/*
+ * Labels keyed on (text, font, scale, color, subpixel order), kept across
+ * frames so each label is shaped and painted by Pango only once. Past
+ * WSK_LABEL_CACHE_MAX labels, the least recently used one makes room. A label
+ * is valid until the next label_cache_get.
+ */
+struct wsk_label_cache {
+	char *font;
+	PangoFontDescription *desc;
+	cairo_surface_t *scratch_surface;
+	cairo_t *scratch;
+	/* Kept across labels rather than made for each */
+	PangoLayout *layout;
+	cairo_font_options_t *options[WSK_LABEL_SUBPIXEL_ORDERS];
+	struct wsk_label *buckets[WSK_LABEL_BUCKETS];
+	struct wsk_label *lru_first, *lru_last;
+	size_t count;
+};
+
+void cairo_set_source_u32(cairo_t *cairo, uint32_t color);
+
+struct wsk_label *label_cache_get(struct wsk_label_cache *cache,
+		const char *font, const char *text, double scale,
+		cairo_subpixel_order_t subpixel, uint32_t color);
+void label_cache_clear(struct wsk_label_cache *cache);
+void label_cache_finish(struct wsk_label_cache *cache);
 
 #endif
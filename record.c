@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "record.h"
+
+static size_t record_padding(size_t len) {
+	size_t size = sizeof(struct wsk_record);
+	return (size - len % size) % size;
+}
+
+bool record_open(struct wsk_recorder *recorder, const char *path) {
+	recorder->file = fopen(path, "w");
+	if (!recorder->file) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct wsk_record_header header = { .version = WSK_RECORD_VERSION };
+	memcpy(header.magic, WSK_RECORD_MAGIC, sizeof(header.magic));
+	if (fwrite(&header, sizeof(header), 1, recorder->file) != 1) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		record_close(recorder);
+		return false;
+	}
+	return true;
+}
+
+static void record_write(struct wsk_recorder *recorder,
+		const struct wsk_record *record) {
+	if (fwrite(record, sizeof(*record), 1, recorder->file) != 1) {
+		fprintf(stderr, "Unable to write record: %s\n", strerror(errno));
+	}
+}
+
+void record_key(struct wsk_recorder *recorder,
+		uint64_t time, uint32_t keycode, uint32_t state) {
+	if (!recorder->file) {
+		return;
+	}
+	struct wsk_record record = {
+		.time = time,
+		.type = WSK_RECORD_KEY,
+		.state = state,
+		.value = keycode,
+	};
+	record_write(recorder, &record);
+}
+
+void record_keymap(struct wsk_recorder *recorder,
+		uint64_t time, const char *keymap) {
+	if (!recorder->file) {
+		return;
+	}
+	size_t len = strlen(keymap);
+	struct wsk_record record = {
+		.time = time,
+		.type = WSK_RECORD_KEYMAP,
+		.value = len,
+	};
+	static const char zeroes[sizeof(struct wsk_record)];
+	record_write(recorder, &record);
+	fwrite(keymap, 1, len, recorder->file);
+	fwrite(zeroes, 1, record_padding(len), recorder->file);
+}
+
+void record_repeat_info(struct wsk_recorder *recorder,
+		uint64_t time, int32_t rate, int32_t delay) {
+	if (!recorder->file) {
+		return;
+	}
+	struct wsk_record record = {
+		.time = time,
+		.type = WSK_RECORD_REPEAT,
+		.state = delay > UINT16_MAX ? UINT16_MAX : delay,
+		.value = rate,
+	};
+	record_write(recorder, &record);
+}
+
+void record_flush(struct wsk_recorder *recorder) {
+	if (recorder->file && fflush(recorder->file) != 0) {
+		fprintf(stderr, "Unable to write record: %s\n", strerror(errno));
+	}
+}
+
+void record_close(struct wsk_recorder *recorder) {
+	if (recorder->file) {
+		fclose(recorder->file);
+		recorder->file = NULL;
+	}
+}
+
+bool replay_open(struct wsk_replay *replay, const char *path) {
+	memset(replay, 0, sizeof(struct wsk_replay));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "fstat: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	const struct wsk_record_header *header = NULL;
+	if ((size_t)st.st_size >= sizeof(*header)) {
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (header == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return false;
+	}
+	if (!header || memcmp(header->magic, WSK_RECORD_MAGIC,
+				sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s is not a wshowkeys recording\n", path);
+		if (header) {
+			munmap((void *)header, st.st_size);
+		}
+		return false;
+	} else if (header->version != WSK_RECORD_VERSION) {
+		fprintf(stderr, "%s is a version %u recording, expected %u\n",
+				path, header->version, WSK_RECORD_VERSION);
+		munmap((void *)header, st.st_size);
+		return false;
+	}
+	replay->data = (const uint8_t *)header;
+	replay->size = st.st_size;
+	replay->offset = sizeof(*header);
+	return true;
+}
+
+/* The next record, or NULL at the end of the log */
+const struct wsk_record *replay_peek(struct wsk_replay *replay) {
+	if (!replay->data
+			|| replay->size - replay->offset < sizeof(struct wsk_record)) {
+		return NULL;
+	}
+	const struct wsk_record *record =
+		(const struct wsk_record *)(replay->data + replay->offset);
+	if (record->type == WSK_RECORD_KEYMAP && record->value
+			> replay->size - replay->offset - sizeof(*record)) {
+		// Truncated, e.g. the recording was cut short
+		return NULL;
+	}
+	return record;
+}
+
+void replay_advance(struct wsk_replay *replay) {
+	const struct wsk_record *record = replay_peek(replay);
+	if (!record) {
+		return;
+	}
+	replay->offset += sizeof(*record);
+	if (record->type == WSK_RECORD_KEYMAP) {
+		replay->offset += record->value + record_padding(record->value);
+		if (replay->offset > replay->size) {
+			replay->offset = replay->size;
+		}
+	}
+}
+
+void replay_close(struct wsk_replay *replay) {
+	if (replay->data) {
+		munmap((void *)replay->data, replay->size);
+	}
+	memset(replay, 0, sizeof(struct wsk_replay));
+}
@@ -0,0 +1,62 @@
+#ifndef _WSK_RECORD_H
+#define _WSK_RECORD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Input sessions are logged as a header followed by fixed-size records, in
+ * host byte order. A keymap record is followed by the keymap text, padded to
+ * the size of a record.
+ */
+#define WSK_RECORD_MAGIC "wskrec\0\0"
+#define WSK_RECORD_VERSION 1
+
+enum wsk_record_type {
+	WSK_RECORD_KEY = 1,
+	WSK_RECORD_KEYMAP = 2,
+	WSK_RECORD_REPEAT = 3,
+};
+
+struct wsk_record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct wsk_record {
+	uint64_t time; // usec, CLOCK_MONOTONIC
+	uint16_t type;
+	/* Key: libinput key state. Repeat: delay in msec */
+	uint16_t state;
+	/* Key: evdev keycode. Keymap: length of the text. Repeat: keys/sec */
+	uint32_t value;
+};
+
+struct wsk_recorder {
+	FILE *file;
+};
+
+bool record_open(struct wsk_recorder *recorder, const char *path);
+void record_key(struct wsk_recorder *recorder,
+		uint64_t time, uint32_t keycode, uint32_t state);
+void record_keymap(struct wsk_recorder *recorder,
+		uint64_t time, const char *keymap);
+void record_repeat_info(struct wsk_recorder *recorder,
+		uint64_t time, int32_t rate, int32_t delay);
+void record_flush(struct wsk_recorder *recorder);
+void record_close(struct wsk_recorder *recorder);
+
+/* A memory-mapped log, read back one record at a time */
+struct wsk_replay {
+	const uint8_t *data;
+	size_t size, offset;
+};
+
+bool replay_open(struct wsk_replay *replay, const char *path);
+const struct wsk_record *replay_peek(struct wsk_replay *replay);
+void replay_advance(struct wsk_replay *replay);
+void replay_close(struct wsk_replay *replay);
+
+#endif
@@ -0,0 +1,601 @@
+#include <cairo/cairo.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blit.h"
+#include "keysym.h"
+#include "pango.h"
+#include "render.h"
+#include "shm.h"
+
+bool keys_init(struct wsk_keys *keys, size_t max) {
+	memset(keys, 0, sizeof(struct wsk_keys));
+	keys->keys = calloc(max, sizeof(struct wsk_keypress));
+	keys->max = max;
+	return keys->keys != NULL;
+}
+
+void keys_finish(struct wsk_keys *keys) {
+	free(keys->keys);
+	keys->keys = NULL;
+}
+
+struct wsk_keypress *keys_at(struct wsk_keys *keys, size_t i) {
+	return &keys->keys[(keys->head + i) % keys->max];
+}
+
+void keys_drop_oldest(struct wsk_keys *keys) {
+	keys->head = (keys->head + 1) % keys->max;
+	--keys->len;
+	++keys->seq;
+}
+
+/* dst must have room for all of src's keys */
+void keys_copy(struct wsk_keys *dst, struct wsk_keys *src) {
+	dst->head = 0;
+	dst->len = src->len;
+	dst->seq = src->seq;
+	for (size_t i = 0; i < src->len; ++i) {
+		dst->keys[i] = *keys_at(src, i);
+	}
+}
+
+struct wsk_keypress *keys_append(struct wsk_keys *keys) {
+	if (keys->len == keys->max) {
+		keys_drop_oldest(keys);
+	}
+	struct wsk_keypress *key = keys_at(keys, keys->len++);
+	memset(key, 0, sizeof(struct wsk_keypress));
+	return key;
+}
+
+void renderer_init(struct wsk_renderer *renderer,
+		const struct wsk_render_config *config,
+		struct wsk_label_cache *labels) {
+	memset(renderer, 0, sizeof(struct wsk_renderer));
+	renderer->config = config;
+	renderer->labels = labels;
+	renderer->subpixel = CAIRO_SUBPIXEL_ORDER_DEFAULT;
+	renderer->changed_seq = UINT64_MAX;
+}
+
+static void atlas_finish(struct wsk_atlas *atlas) {
+	free(atlas->data);
+	free(atlas->special);
+	memset(atlas, 0, sizeof(struct wsk_atlas));
+}
+
+void renderer_finish(struct wsk_renderer *renderer) {
+	atlas_finish(&renderer->atlas);
+}
+
+/* Makes the next frame a full redraw */
+void render_invalidate(struct wsk_renderer *renderer) {
+	renderer->drawn_end = renderer->drawn_start;
+}
+
+void render_key_changed(struct wsk_renderer *renderer, uint64_t seq) {
+	if (seq < renderer->changed_seq) {
+		renderer->changed_seq = seq;
+	}
+}
+
+static struct wsk_label *key_label(struct wsk_renderer *renderer,
+		struct wsk_keypress *key, int scale) {
+	const struct wsk_render_config *config = renderer->config;
+	char buf[64];
+	const char *name = keysym_label_text(key->sym, key->label,
+			buf, sizeof(buf));
+	uint32_t color = key->label == KEYSYM_LABEL_CHAR ?
+		config->foreground : config->specialfg;
+	char repeated[sizeof(buf) + 16];
+	if (key->repeat > 1) {
+		snprintf(repeated, sizeof(repeated), "%s ×%u", name, key->repeat);
+		name = repeated;
+	}
+
+	return label_cache_get(renderer->labels, config->font, name,
+			(double)scale / WSK_SCALE_BASE,
+			renderer->subpixel, color);
+}
+
+/* Copies label into a new tile at the end of the atlas */
+static void atlas_add(struct wsk_atlas *atlas, struct wsk_atlas_tile *tile,
+		struct wsk_label *label) {
+	if (!label || label->width <= 0 || label->height <= 0) {
+		return;
+	}
+	size_t size = (size_t)label->width * label->height;
+	uint32_t *data = realloc(atlas->data,
+			(atlas->size + size) * sizeof(uint32_t));
+	if (!data) {
+		return;
+	}
+	atlas->data = data;
+	cairo_surface_flush(label->surface);
+	const uint8_t *src = cairo_image_surface_get_data(label->surface);
+	int stride = cairo_image_surface_get_stride(label->surface);
+	for (int y = 0; y < label->height; ++y) {
+		memcpy(data + atlas->size + (size_t)y * label->width,
+				src + (size_t)y * stride, label->width * sizeof(uint32_t));
+	}
+	*tile = (struct wsk_atlas_tile){
+		.offset = atlas->size,
+		.width = label->width,
+		.height = label->height,
+	};
+	atlas->size += size;
+}
+
+/* Renders all of the labels which go into the atlas at scale */
+static void atlas_build(struct wsk_renderer *renderer, int scale) {
+	const struct wsk_render_config *config = renderer->config;
+	struct wsk_atlas *atlas = &renderer->atlas;
+	atlas_finish(atlas);
+	atlas->scale = scale;
+
+	for (char c = '!'; c <= '~'; ++c) {
+		char text[] = { c, '\0' };
+		atlas_add(atlas, &atlas->ascii[c - '!'], label_cache_get(
+				renderer->labels, config->font, text,
+				(double)scale / WSK_SCALE_BASE,
+				renderer->subpixel, config->foreground));
+	}
+	atlas->nspecial = keysym_label_count();
+	atlas->special = calloc(atlas->nspecial, sizeof(struct wsk_atlas_tile));
+	if (!atlas->special) {
+		atlas->nspecial = 0;
+	}
+	for (size_t i = 0; i < atlas->nspecial; ++i) {
+		char buf[64];
+		const char *text = keysym_label_text(0, i, buf, sizeof(buf));
+		atlas_add(atlas, &atlas->special[i], label_cache_get(
+				renderer->labels, config->font, text,
+				(double)scale / WSK_SCALE_BASE,
+				renderer->subpixel, config->specialfg));
+	}
+}
+
+/* The atlas tile for key at scale, or NULL if it has none */
+static const struct wsk_atlas_tile *key_tile(struct wsk_renderer *renderer,
+		struct wsk_keypress *key, int scale) {
+	struct wsk_atlas *atlas = &renderer->atlas;
+	if (atlas->scale != scale) {
+		atlas_build(renderer, scale);
+	}
+	const struct wsk_atlas_tile *tile = NULL;
+	if (key->repeat > 1) {
+		return NULL;
+	} else if (key->label == KEYSYM_LABEL_CHAR) {
+		// The printable ASCII keysyms are their own codepoints
+		if (key->sym >= '!' && key->sym <= '~') {
+			tile = &atlas->ascii[key->sym - '!'];
+		}
+	} else if (key->label < atlas->nspecial) {
+		tile = &atlas->special[key->label];
+	}
+	return tile && tile->width > 0 ? tile : NULL;
+}
+
+/* The size of key's label at scale; false if it can't be drawn */
+static bool key_size(struct wsk_renderer *renderer,
+		struct wsk_keypress *key, int scale, int *width, int *height) {
+	const struct wsk_atlas_tile *tile = key_tile(renderer, key, scale);
+	if (tile) {
+		*width = tile->width;
+		*height = tile->height;
+		return true;
+	}
+	struct wsk_label *label = key_label(renderer, key, scale);
+	if (!label) {
+		return false;
+	}
+	*width = label->width;
+	*height = label->height;
+	return true;
+}
+
+static void measure_keys(struct wsk_renderer *renderer, struct wsk_keys *keys,
+		size_t first, size_t end, int scale,
+		uint32_t *width, uint32_t *height) {
+	for (size_t i = first; i < end; ++i) {
+		int key_width, key_height;
+		if (!key_size(renderer, keys_at(keys, i), scale,
+					&key_width, &key_height)) {
+			continue;
+		}
+		*width = *width + key_width;
+		if ((int)*height < key_height) {
+			*height = key_height;
+		}
+	}
+}
+
+/*
+ * The surface width for keys taking up width buffer pixels at scale, in
+ * surface pixels; 0 if there are none
+ */
+uint32_t render_surface_width(struct wsk_renderer *renderer,
+		uint32_t width, int scale) {
+	uint32_t need = ((uint64_t)width * WSK_SCALE_BASE + scale - 1) / scale;
+	uint32_t current = renderer->surface_width;
+	if (need == 0) {
+		current = 0;
+	} else if (renderer->config->ticker_width) {
+		current = renderer->config->ticker_width;
+	} else if (need > current || need < current / 2) {
+		// Leave room for a few more keys before growing again
+		need += need / 4;
+		current = (need + WSK_SIZE_STEP - 1) / WSK_SIZE_STEP * WSK_SIZE_STEP;
+	}
+	renderer->surface_width = current;
+	return current;
+}
+
+/* Converts surface pixels to buffer pixels at scale, rounding half up */
+static uint32_t buffer_size(uint32_t size, int scale) {
+	return ((uint64_t)size * scale + WSK_SCALE_BASE / 2) / WSK_SCALE_BASE;
+}
+
+/* Opacity of a key at time t (usec) as it animates out */
+double render_key_alpha(const struct wsk_render_config *config,
+		struct wsk_keypress *key, uint64_t t) {
+	uint64_t start = key->time + config->timeout;
+	if (config->animation == WSK_ANIMATION_NONE || t <= start) {
+		return 1.0;
+	} else if (t >= start + WSK_ANIMATION_DURATION) {
+		return 0.0;
+	}
+	return 1.0 - (double)(t - start) / WSK_ANIMATION_DURATION;
+}
+
+/* Fills a rectangle of buffer, as much of it as is inside */
+static void fill_rect(struct pool_buffer *buffer, int32_t x, uint32_t y,
+		int32_t width, uint32_t height, uint32_t pixel) {
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+	if (width <= 0 || (uint32_t)x >= buffer->width || y >= buffer->height) {
+		return;
+	}
+	width = (uint32_t)width < buffer->width - x ?
+		width : (int32_t)(buffer->width - x);
+	height = height < buffer->height - y ? height : buffer->height - y;
+	blit_fill((uint32_t *)buffer->data + (size_t)y * buffer->width + x,
+			buffer->width, width, height, pixel);
+}
+
+/* Blends the top of a tile over buffer at (x, y), within height rows */
+static void blit_tile(struct pool_buffer *buffer, struct wsk_atlas *atlas,
+		const struct wsk_atlas_tile *tile, int32_t x, uint32_t y,
+		uint32_t height, uint8_t alpha) {
+	// Columns off the left edge, when scrolled
+	uint32_t skip = x < 0 ? (uint32_t)-x : 0;
+	if (skip >= (uint32_t)tile->width || x >= (int32_t)buffer->width
+			|| y >= height || y >= buffer->height) {
+		return;
+	}
+	x += skip;
+	uint32_t width = tile->width - skip;
+	width = width < buffer->width - x ? width : buffer->width - x;
+	height = height < buffer->height ? height : buffer->height;
+	uint32_t rows = height - y;
+	rows = rows < (uint32_t)tile->height ? rows : (uint32_t)tile->height;
+	blit_over((uint32_t *)buffer->data + (size_t)y * buffer->width + x,
+			buffer->width, atlas->data + tile->offset + skip, tile->width,
+			width, rows, alpha);
+}
+
+/*
+ * Draws keys [first, end) starting at x, as they should look at time t, and
+ * returns where the last one ends. Keys with an atlas tile are written
+ * straight into the buffer; only the others are drawn with cairo.
+ */
+static int32_t render_keys(struct pool_buffer *buffer,
+		struct wsk_renderer *renderer, struct wsk_keys *keys,
+		size_t first, size_t end, int scale,
+		int32_t x, uint32_t height, uint64_t t) {
+	const struct wsk_render_config *config = renderer->config;
+	uint32_t background = blit_premultiply(config->background);
+	int32_t start = x;
+	bool fallback = false;
+
+	cairo_surface_flush(buffer->surface);
+	for (size_t i = first; i < end; ++i) {
+		struct wsk_keypress *key = keys_at(keys, i);
+		int width, key_height;
+		if (!key_size(renderer, key, scale, &width, &key_height)) {
+			continue;
+		}
+		fill_rect(buffer, x, 0, width, height, background);
+
+		const struct wsk_atlas_tile *tile = key_tile(renderer, key, scale);
+		double alpha = render_key_alpha(config, key, t);
+		if (!tile) {
+			fallback = true;
+		} else if (alpha > 0.0) {
+			uint32_t y = 0;
+			if (config->animation == WSK_ANIMATION_SLIDE) {
+				y = lround((1.0 - alpha) * height);
+			}
+			blit_tile(buffer, &renderer->atlas, tile, x, y, height,
+					lround(alpha * 255));
+		}
+		x += width;
+	}
+	cairo_surface_mark_dirty(buffer->surface);
+	if (!fallback) {
+		return x;
+	}
+
+	/* Labels which aren't in the atlas, e.g. "a ×3" */
+	cairo_t *cairo = buffer->cairo;
+	x = start;
+	for (size_t i = first; i < end; ++i) {
+		struct wsk_keypress *key = keys_at(keys, i);
+		int width, key_height;
+		if (!key_size(renderer, key, scale, &width, &key_height)) {
+			continue;
+		}
+		double alpha = render_key_alpha(config, key, t);
+		struct wsk_label *label;
+		if (alpha > 0.0 && x + width > 0
+				&& !key_tile(renderer, key, scale)
+				&& (label = key_label(renderer, key, scale))) {
+			double y = 0;
+			if (config->animation == WSK_ANIMATION_SLIDE) {
+				y = (1.0 - alpha) * height;
+			}
+			cairo_save(cairo);
+			cairo_rectangle(cairo, x, 0, label->width, height);
+			cairo_clip(cairo);
+			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+			cairo_set_source_surface(cairo, label->surface, x, y);
+			cairo_paint_with_alpha(cairo, alpha);
+			cairo_restore(cairo);
+		}
+		x += width;
+	}
+	return x;
+}
+
+/* Copies src into dst, shift pixels further left */
+static void copy_buffer(struct pool_buffer *dst, struct pool_buffer *src,
+		uint32_t shift) {
+	uint32_t width = src->width < dst->width ? src->width : dst->width;
+	uint32_t height = src->height < dst->height ? src->height : dst->height;
+	if (shift >= width) {
+		return;
+	}
+	cairo_surface_flush(src->surface);
+	cairo_surface_flush(dst->surface);
+	for (uint32_t y = 0; y < height; ++y) {
+		memmove((uint8_t *)dst->data + y * dst->width * 4,
+				(uint8_t *)src->data + (y * src->width + shift) * 4,
+				(width - shift) * 4);
+	}
+	cairo_surface_mark_dirty(dst->surface);
+}
+
+/* The box key is drawn in on its own for -S; false if it can't be drawn */
+bool render_key_box(struct wsk_renderer *renderer, struct wsk_keypress *key,
+		int scale, struct wsk_key_box *box) {
+	int width, height;
+	if (!key_size(renderer, key, scale, &width, &height)) {
+		return false;
+	}
+	// Whole surface pixels, so boxes can be put side by side
+	box->width = ((uint64_t)width * WSK_SCALE_BASE + scale - 1) / scale;
+	box->height = ((uint64_t)height * WSK_SCALE_BASE + scale - 1) / scale;
+	box->buffer_width = buffer_size(box->width, scale);
+	box->buffer_height = buffer_size(box->height, scale);
+	return box->buffer_width > 0 && box->buffer_height > 0;
+}
+
+/* Draws key on its own into buffer, which has the size of its box */
+void render_key(struct wsk_renderer *renderer, struct wsk_keypress *key,
+		int scale, struct pool_buffer *buffer) {
+	const struct wsk_render_config *config = renderer->config;
+	cairo_surface_flush(buffer->surface);
+	fill_rect(buffer, 0, 0, buffer->width, buffer->height,
+			blit_premultiply(config->background));
+	const struct wsk_atlas_tile *tile = key_tile(renderer, key, scale);
+	if (tile) {
+		blit_tile(buffer, &renderer->atlas, tile, 0, 0, buffer->height, 255);
+		cairo_surface_mark_dirty(buffer->surface);
+		return;
+	}
+	cairo_surface_mark_dirty(buffer->surface);
+	struct wsk_label *label = key_label(renderer, key, scale);
+	if (label) {
+		cairo_t *cairo = buffer->cairo;
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		cairo_set_source_surface(cairo, label->surface, 0, 0);
+		cairo_paint(cairo);
+		cairo_surface_flush(buffer->surface);
+	}
+}
+
+/*
+ * Works out the size the keys need at frame->scale, the buffer to draw them
+ * in, and whether they can be appended to what the last buffer holds.
+ */
+void render_plan(struct wsk_renderer *renderer, struct wsk_keys *keys,
+		struct wsk_frame *frame) {
+	const struct wsk_render_config *config = renderer->config;
+	int scale = frame->scale;
+
+	/*
+	 * The keys of the last buffer which are still in the ring can be kept,
+	 * if no other than the last of them changed since, and only the keys
+	 * after them drawn. Evicting keys, or appending keys against the right
+	 * edge, moves the kept ones over, which is done by shifting the pixels.
+	 */
+	uint64_t kept_end = renderer->drawn_end;
+	uint64_t changed = renderer->changed_seq;
+	bool append = keys->len > 0 && renderer->current_buffer
+		&& kept_end > keys->seq
+		&& renderer->drawn_scale == scale;
+	if (append && changed >= keys->seq && changed < kept_end) {
+		if (changed + 1 == kept_end) {
+			// It was updated in place, e.g. its repeat count went up
+			--kept_end;
+		} else {
+			append = false;
+		}
+	}
+	size_t first = append ? kept_end - keys->seq : 0;
+	uint32_t head = 0, height = 0;
+	measure_keys(renderer, keys, 0, first, scale, &head, &height);
+	uint32_t width = head;
+	measure_keys(renderer, keys, first, keys->len, scale, &width, &height);
+	if (append && height != renderer->drawn_height) {
+		// A taller or shorter label changes the layout of the whole line
+		append = false;
+	}
+
+	uint32_t surface_width = render_surface_width(renderer, width, scale);
+	// Rows which don't make up a whole surface pixel are cut off
+	uint32_t surface_height = (uint64_t)height * WSK_SCALE_BASE / scale;
+	uint32_t buffer_width = buffer_size(surface_width, scale);
+	uint32_t buffer_height = buffer_size(surface_height, scale);
+	if (buffer_width == 0 || buffer_height == 0) {
+		surface_width = surface_height = 0;
+		buffer_width = buffer_height = 0;
+	}
+	int32_t left = 0;
+	if (config->align_right || config->ticker_width) {
+		left = (int32_t)buffer_width - (int32_t)width;
+	}
+	int32_t shift = 0;
+	if (append) {
+		// Where the kept keys end, in the last buffer and in this one
+		int32_t kept_right = renderer->drawn_right;
+		if (kept_end != renderer->drawn_end) {
+			kept_right -= renderer->drawn_last_width;
+		}
+		shift = kept_right - (left + (int32_t)head);
+		if (shift < 0 || (shift > 0
+					&& buffer_width != renderer->buffer_width)) {
+			append = false;
+		}
+	}
+	if (!append) {
+		first = 0;
+		head = 0;
+		shift = 0;
+	}
+
+	frame->surface_width = surface_width;
+	frame->surface_height = surface_height;
+	frame->width = buffer_width;
+	frame->height = buffer_height;
+	frame->content_width = width;
+	frame->content_height = height;
+	frame->left = left;
+	frame->shift = shift;
+	frame->append = append;
+	frame->first = first;
+	frame->x = head;
+	frame->ndamage = 0;
+}
+
+/*
+ * Draws a planned frame into buffer, which the frame must fit. The keys get
+ * the background colour; the rest of the buffer is left transparent.
+ */
+void render_draw(struct wsk_renderer *renderer, struct wsk_keys *keys,
+		struct wsk_frame *frame, struct pool_buffer *buffer) {
+	const struct wsk_render_config *config = renderer->config;
+	struct pool_buffer *prev = renderer->current_buffer;
+	bool append = frame->append;
+	size_t first = frame->first;
+	int32_t left = frame->left;
+	int32_t x = left + (int32_t)frame->x;
+	uint32_t shift = frame->shift;
+	uint32_t height = frame->content_height;
+	int scale = frame->scale;
+	uint64_t t = frame->time;
+
+	bool resized = buffer->width != renderer->buffer_width
+		|| buffer->height != renderer->buffer_height;
+	if (append && buffer != prev) {
+		// Carry the previous frame over into the buffer we were given
+		copy_buffer(buffer, prev, shift);
+	} else if (append && buffer->fresh) {
+		// The previous buffer was re-created
+		append = false;
+		first = 0;
+		x = left;
+	} else if (append && shift) {
+		copy_buffer(buffer, buffer, shift);
+	}
+	renderer->current_buffer = buffer;
+	renderer->buffer_width = buffer->width;
+	renderer->buffer_height = buffer->height;
+
+	/* Keys animating out are always the oldest ones */
+	size_t animating = 0;
+	while (animating < keys->len && render_key_alpha(config,
+				keys_at(keys, animating), t) < 1.0) {
+		++animating;
+	}
+	renderer->animating = animating > 0;
+	if (animating > first) {
+		animating = first;
+	}
+
+	cairo_surface_flush(buffer->surface);
+	if (!append) {
+		fill_rect(buffer, 0, 0, buffer->width, buffer->height, 0);
+	} else {
+		// Clear what the kept keys no longer cover, on either side
+		fill_rect(buffer, 0, 0, left, buffer->height, 0);
+		fill_rect(buffer, x, 0, (int32_t)buffer->width - x,
+				buffer->height, 0);
+	}
+	int32_t right = render_keys(buffer, renderer, keys, first, keys->len,
+			scale, x, height, t);
+	int32_t animated_right = 0;
+	if (append && animating) {
+		animated_right = render_keys(buffer, renderer, keys,
+				0, animating, scale, left, height, t);
+	}
+	cairo_surface_flush(buffer->surface);
+
+	renderer->drawn_start = keys->seq;
+	renderer->drawn_end = keys->seq + keys->len;
+	renderer->changed_seq = UINT64_MAX;
+	renderer->drawn_last_width = 0;
+	int last_width, last_height;
+	if (keys->len && key_size(renderer, keys_at(keys, keys->len - 1),
+				scale, &last_width, &last_height)) {
+		renderer->drawn_last_width = last_width;
+	}
+	renderer->drawn_right = right;
+	renderer->drawn_height = height;
+	renderer->drawn_scale = scale;
+
+	if (append && !resized && !shift) {
+		x = x < 0 ? 0 : x;
+		x = x < (int32_t)buffer->width ? x : (int32_t)buffer->width;
+		frame->damage[frame->ndamage++] = (struct wsk_damage){
+			x, 0, buffer->width - x, buffer->height,
+		};
+		// Keys animating out, and any evicted since on the left
+		int32_t redrawn = animated_right > left ? animated_right : left;
+		if (redrawn > 0) {
+			frame->damage[frame->ndamage++] = (struct wsk_damage){
+				0, 0, redrawn, buffer->height,
+			};
+		}
+	} else {
+		frame->damage[frame->ndamage++] = (struct wsk_damage){
+			0, 0, buffer->width, buffer->height,
+		};
+	}
+}
@@ -0,0 +1,157 @@
+#ifndef _WSK_RENDER_H
+#define _WSK_RENDER_H
+#include <cairo/cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xkbcommon/xkbcommon.h>
+#include "pango.h"
+#include "shm.h"
+
+/* How long keys take to animate out after their timeout, in usec */
+#define WSK_ANIMATION_DURATION 250000
+
+/* Scales are in 120ths, as wp_fractional_scale_v1 gives them */
+#define WSK_SCALE_BASE 120
+
+/* Surface widths are rounded up to a multiple of this, in surface pixels */
+#define WSK_SIZE_STEP 64
+
+enum wsk_animation {
+	WSK_ANIMATION_NONE,
+	WSK_ANIMATION_FADE,
+	WSK_ANIMATION_SLIDE,
+};
+
+struct wsk_keypress {
+	uint64_t time; // usec, CLOCK_MONOTONIC
+	xkb_keysym_t sym;
+	uint16_t label; // see keysym.h
+	uint16_t repeat; // shown as "a ×12" when above 1
+};
+
+/* Ring of max keypresses, oldest first; seq numbers keys[head] */
+struct wsk_keys {
+	struct wsk_keypress *keys;
+	size_t max, head, len;
+	uint64_t seq;
+};
+
+struct wsk_render_config {
+	uint32_t foreground, background, specialfg;
+	const char *font;
+	uint64_t timeout; // usec
+	enum wsk_animation animation;
+	/* Keys are drawn against the right edge of the surface */
+	bool align_right;
+	/*
+	 * If not 0, the surface width, in surface pixels. New keys come in on
+	 * the right and push older ones out on the left.
+	 */
+	uint32_t ticker_width;
+};
+
+/* A label in an atlas: width * height pixels at data + offset */
+struct wsk_atlas_tile {
+	size_t offset;
+	int width, height;
+};
+
+/*
+ * The labels of printable ASCII and of the special keys, rendered once for
+ * a scale and kept as premultiplied ARGB32, so they can be blitted into a
+ * buffer without going through cairo. Tiles for labels which failed to
+ * render have no width.
+ */
+struct wsk_atlas {
+	int scale; // 0 until built
+	uint32_t *data;
+	size_t size; // pixels
+	struct wsk_atlas_tile ascii['~' - '!' + 1];
+	struct wsk_atlas_tile *special; // by keysym label
+	size_t nspecial;
+};
+
+struct wsk_renderer {
+	const struct wsk_render_config *config;
+	struct wsk_label_cache *labels;
+	cairo_subpixel_order_t subpixel;
+	struct wsk_atlas atlas;
+
+	/*
+	 * What the last buffer drawn holds, as a range of key sequence numbers,
+	 * so new keys can be appended to it
+	 */
+	struct pool_buffer *current_buffer;
+	uint32_t buffer_width, buffer_height;
+	uint64_t drawn_start, drawn_end;
+	int32_t drawn_right; // where the last key drawn ends
+	uint32_t drawn_height, drawn_last_width;
+	int drawn_scale;
+	/*
+	 * The surface width last chosen, in surface pixels. It grows in steps
+	 * ahead of the keys and only shrinks once they take up less than half,
+	 * so most keys fit without the surface being configured again.
+	 */
+	uint32_t surface_width;
+	/* A key updated in place since it was drawn, UINT64_MAX if none */
+	uint64_t changed_seq;
+	/* Whether keys were animating out in the last frame */
+	bool animating;
+};
+
+struct wsk_damage {
+	int32_t x, y, width, height;
+};
+
+/* A key drawn on its own, for -S */
+struct wsk_key_box {
+	uint32_t width, height; // surface pixels
+	uint32_t buffer_width, buffer_height;
+};
+
+/* A frame, as planned by render_plan and then drawn by render_draw */
+struct wsk_frame {
+	int scale; // in 120ths
+	uint64_t time; // usec, when the frame is expected on screen
+	uint32_t surface_width, surface_height;
+	uint32_t width, height; // buffer pixels, surface size times scale
+	uint32_t content_width, content_height; // buffer pixels the keys take up
+	int32_t left; // where the keys start in the buffer, < 0 if cut off
+	/* How far what the last buffer holds is moved left when appending */
+	uint32_t shift;
+	bool append;
+	size_t first;
+	uint32_t x; // from left
+	/* Filled in by render_draw, in buffer coordinates */
+	struct wsk_damage damage[2];
+	size_t ndamage;
+};
+
+bool keys_init(struct wsk_keys *keys, size_t max);
+void keys_finish(struct wsk_keys *keys);
+struct wsk_keypress *keys_at(struct wsk_keys *keys, size_t i);
+struct wsk_keypress *keys_append(struct wsk_keys *keys);
+void keys_drop_oldest(struct wsk_keys *keys);
+void keys_copy(struct wsk_keys *dst, struct wsk_keys *src);
+
+void renderer_init(struct wsk_renderer *renderer,
+		const struct wsk_render_config *config,
+		struct wsk_label_cache *labels);
+void renderer_finish(struct wsk_renderer *renderer);
+void render_invalidate(struct wsk_renderer *renderer);
+void render_key_changed(struct wsk_renderer *renderer, uint64_t seq);
+double render_key_alpha(const struct wsk_render_config *config,
+		struct wsk_keypress *key, uint64_t t);
+uint32_t render_surface_width(struct wsk_renderer *renderer,
+		uint32_t width, int scale);
+bool render_key_box(struct wsk_renderer *renderer, struct wsk_keypress *key,
+		int scale, struct wsk_key_box *box);
+void render_key(struct wsk_renderer *renderer, struct wsk_keypress *key,
+		int scale, struct pool_buffer *buffer);
+void render_plan(struct wsk_renderer *renderer, struct wsk_keys *keys,
+		struct wsk_frame *frame);
+void render_draw(struct wsk_renderer *renderer, struct wsk_keys *keys,
+		struct wsk_frame *frame, struct pool_buffer *buffer);
+
+#endif
@@ -1,9 +1,11 @@
 /* Portions of this file taken from sway, MIT licensed */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <cairo/cairo.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pango/pangocairo.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -23,6 +25,15 @@ static void randname(char *buf) {
 }
 
 int create_shm_file(void) {
+#ifdef MFD_CLOEXEC
+	int fd = memfd_create("wshowkeys-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		/* The pool only ever grows; let the compositor rely on that */
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+#endif
+
 	int retries = 100;
 	do {
 		char name[] = "/wl_shm-XXXXXX";
@@ -67,77 +78,329 @@ static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
-static struct pool_buffer *create_buffer(struct wl_shm *shm,
-		struct pool_buffer *buf, int32_t width, int32_t height,
-		uint32_t format) {
-	uint32_t stride = width * 4;
-	size_t size = stride * height;
+static size_t round_capacity(size_t size) {
+	/* Leave room to grow so a widening line doesn't reallocate every key */
+	size_t page = 4096;
+	size = size + size / 2;
+	return (size + page - 1) / page * page;
+}
 
-	int fd = allocate_shm_file(size);
-	assert(fd != -1);
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	buf->buffer = wl_shm_pool_create_buffer(pool, 0,
-			width, height, stride, format);
-	wl_shm_pool_destroy(pool);
-	close(fd);
+static void destroy_buffer_cairo(struct pool_buffer *buffer) {
+	if (buffer->cairo) {
+		cairo_destroy(buffer->cairo);
+		buffer->cairo = NULL;
+	}
+	if (buffer->surface) {
+		cairo_surface_destroy(buffer->surface);
+		buffer->surface = NULL;
+	}
+}
 
-	buf->size = size;
-	buf->width = width;
-	buf->height = height;
-	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
+/* Points the buffer's cairo objects at its region of the pool mapping */
+static void map_buffer(struct shm_pool *pool, struct pool_buffer *buf) {
+	destroy_buffer_cairo(buf);
+	buf->data = (uint8_t *)pool->data + buf->offset;
+	buf->surface = cairo_image_surface_create_for_data(buf->data,
+			CAIRO_FORMAT_ARGB32, buf->width, buf->height, buf->width * 4);
 	buf->cairo = cairo_create(buf->surface);
-	buf->pango = pango_cairo_create_context(buf->cairo);
+}
 
+/* (Re-)creates the wl_buffer for the buffer's current offset and size */
+static void create_buffer(struct shm_pool *pool, struct pool_buffer *buf,
+		uint32_t width, uint32_t height) {
+	if (buf->buffer) {
+		wl_buffer_destroy(buf->buffer);
+	}
+	buf->width = width;
+	buf->height = height;
+	buf->buffer = wl_shm_pool_create_buffer(pool->pool, buf->offset,
+			width, height, width * 4, WL_SHM_FORMAT_ARGB8888);
 	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
-	return buf;
+	map_buffer(pool, buf);
 }
 
 void destroy_buffer(struct pool_buffer *buffer) {
 	if (buffer->buffer) {
 		wl_buffer_destroy(buffer->buffer);
 	}
-	if (buffer->cairo) {
-		cairo_destroy(buffer->cairo);
+	destroy_buffer_cairo(buffer);
+	memset(buffer, 0, sizeof(struct pool_buffer));
+}
+
+static bool map_pool(struct shm_pool *pool, size_t size) {
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, pool->fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
 	}
-	if (buffer->surface) {
-		cairo_surface_destroy(buffer->surface);
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+	}
+	pool->data = data;
+	pool->size = size;
+	for (size_t i = 0; i < WSK_MAX_BUFFERS; ++i) {
+		if (pool->buffers[i].buffer) {
+			map_buffer(pool, &pool->buffers[i]);
+		}
+	}
+	return true;
+}
+
+/* Grows the pool in place so it holds at least size bytes */
+static bool reserve_pool(struct shm_pool *pool, size_t size) {
+	if (pool->pool && size <= pool->size) {
+		return true;
+	}
+	size = round_capacity(size);
+
+	if (!pool->pool) {
+		pool->fd = allocate_shm_file(size);
+		if (pool->fd < 0) {
+			return false;
+		}
+		if (!map_pool(pool, size)) {
+			close(pool->fd);
+			pool->fd = -1;
+			return false;
+		}
+		pool->pool = wl_shm_create_pool(pool->shm, pool->fd, size);
+		return true;
+	}
+
+	int ret;
+	do {
+		ret = ftruncate(pool->fd, size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 || !map_pool(pool, size)) {
+		return false;
+	}
+	wl_shm_pool_resize(pool->pool, size);
+	return true;
+}
+
+/*
+ * Once more than half of the pool is left behind by buffers that moved,
+ * moves every buffer down to the start of the pool, in offset order, and
+ * gives each only the room its current size needs. Contents are kept.
+ * Must only be called while the compositor holds none of the buffers.
+ */
+static void compact_pool(struct shm_pool *pool) {
+	struct pool_buffer *order[WSK_MAX_BUFFERS];
+	size_t n = 0, live = 0;
+	for (size_t i = 0; i < WSK_MAX_BUFFERS; ++i) {
+		struct pool_buffer *buf = &pool->buffers[i];
+		if (!buf->buffer) {
+			continue;
+		}
+		live += buf->capacity;
+		size_t j = n++;
+		while (j > 0 && order[j - 1]->offset > buf->offset) {
+			order[j] = order[j - 1];
+			--j;
+		}
+		order[j] = buf;
 	}
-	if (buffer->pango) {
-		g_object_unref(buffer->pango);
+	if (live * 2 >= pool->used) {
+		return;
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
+
+	size_t offset = 0;
+	for (size_t i = 0; i < n; ++i) {
+		struct pool_buffer *buf = order[i];
+		size_t size = (size_t)buf->width * 4 * buf->height;
+		if (buf->offset != offset) {
+			memmove((uint8_t *)pool->data + offset,
+					(uint8_t *)pool->data + buf->offset, size);
+			buf->offset = offset;
+			create_buffer(pool, buf, buf->width, buf->height);
+		}
+		buf->capacity = round_capacity(size);
+		offset += buf->capacity;
+	}
+	pool->used = offset;
+}
+
+/*
+ * Re-creates the pool at the size currently in use, after it has been
+ * SHM_SHRINK_RATIO times too large for SHM_SHRINK_DELAY seconds. Like
+ * compact_pool, only valid while no buffer is busy.
+ */
+static void shrink_pool(struct shm_pool *pool) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (pool->used * SHM_SHRINK_RATIO > pool->size) {
+		pool->oversized_since.tv_sec = 0;
+		return;
+	}
+	if (pool->oversized_since.tv_sec == 0) {
+		pool->oversized_since = now;
+		return;
+	}
+	if (now.tv_sec - pool->oversized_since.tv_sec < SHM_SHRINK_DELAY) {
+		return;
+	}
+	pool->oversized_since.tv_sec = 0;
+
+	size_t size = round_capacity(pool->used);
+	int fd = allocate_shm_file(size);
+	if (fd < 0) {
+		return;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	memcpy(data, pool->data, pool->used);
+
+	wl_shm_pool_destroy(pool->pool);
+	munmap(pool->data, pool->size);
+	close(pool->fd);
+	pool->fd = fd;
+	pool->data = data;
+	pool->size = size;
+	pool->pool = wl_shm_create_pool(pool->shm, fd, size);
+	for (size_t i = 0; i < WSK_MAX_BUFFERS; ++i) {
+		struct pool_buffer *buf = &pool->buffers[i];
+		if (buf->buffer) {
+			create_buffer(pool, buf, buf->width, buf->height);
+		}
+	}
+}
+
+void shm_pool_init(struct shm_pool *pool, struct wl_shm *shm, size_t depth) {
+	memset(pool, 0, sizeof(struct shm_pool));
+	pool->shm = shm;
+	pool->fd = -1;
+	pool->depth = depth;
+}
+
+void shm_pool_finish(struct shm_pool *pool) {
+	for (size_t i = 0; i < WSK_MAX_BUFFERS; ++i) {
+		destroy_buffer(&pool->buffers[i]);
+	}
+	if (pool->pool) {
+		wl_shm_pool_destroy(pool->pool);
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
 	}
+	if (pool->shm && pool->fd >= 0) {
+		close(pool->fd);
+	}
+	pool->pool = NULL;
+	pool->data = NULL;
+	pool->fd = -1;
+}
+
+bool create_single_buffer(struct pool_buffer *buffer, struct wl_shm *shm,
+		uint32_t width, uint32_t height) {
 	memset(buffer, 0, sizeof(struct pool_buffer));
+	size_t size = (size_t)width * 4 * height;
+	int fd = allocate_shm_file(size);
+	if (fd < 0) {
+		return false;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	// The buffer keeps the pool alive for as long as it needs it
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+	buffer->buffer = wl_shm_pool_create_buffer(pool, 0,
+			width, height, width * 4, WL_SHM_FORMAT_ARGB8888);
+	wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->capacity = size;
+	buffer->data = data;
+	buffer->surface = cairo_image_surface_create_for_data(data,
+			CAIRO_FORMAT_ARGB32, width, height, width * 4);
+	buffer->cairo = cairo_create(buffer->surface);
+	buffer->fresh = true;
+	return true;
+}
+
+void destroy_single_buffer(struct pool_buffer *buffer) {
+	void *data = buffer->data;
+	size_t size = buffer->capacity;
+	destroy_buffer(buffer);
+	if (data) {
+		munmap(data, size);
+	}
 }
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
+struct pool_buffer *get_next_buffer(struct shm_pool *pool,
+		uint32_t width, uint32_t height) {
 	struct pool_buffer *buffer = NULL;
+	size_t needed = (size_t)width * 4 * height;
+
+	bool idle = true;
+	for (size_t i = 0; i < pool->depth; ++i) {
+		idle = idle && !pool->buffers[i].busy;
+	}
+	if (idle && pool->pool) {
+		compact_pool(pool);
+		shrink_pool(pool);
+	}
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
+	/*
+	 * Prefer an idle buffer which already has the right size, then one with
+	 * enough room, then anything idle. Unallocated slots only get used when
+	 * everything else is held by the compositor.
+	 */
+	int best = -1;
+	for (size_t i = 0; i < pool->depth; ++i) {
+		if (pool->buffers[i].busy) {
 			continue;
 		}
-		buffer = &pool[i];
+		int score = 0;
+		if (pool->buffers[i].buffer) {
+			score = 1;
+			if (pool->buffers[i].capacity >= needed) {
+				score = 2;
+			}
+			if (pool->buffers[i].width == width
+					&& pool->buffers[i].height == height) {
+				score = 3;
+			}
+		}
+		if (score > best) {
+			best = score;
+			buffer = &pool->buffers[i];
+		}
 	}
 
 	if (!buffer) {
 		return NULL;
 	}
 
-	if (buffer->width != width || buffer->height != height) {
-		destroy_buffer(buffer);
-	}
-
-	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
+	buffer->fresh = true;
+	if (!buffer->buffer || buffer->capacity < needed) {
+		/*
+		 * Grow in place if this buffer is at the end of the pool, otherwise
+		 * take new room at the end; compact_pool reclaims the old region.
+		 */
+		if (!buffer->buffer
+				|| buffer->offset + buffer->capacity != pool->used) {
+			buffer->offset = pool->used;
+		}
+		size_t capacity = round_capacity(needed);
+		if (!reserve_pool(pool, buffer->offset + capacity)) {
+			destroy_buffer(buffer);
 			return NULL;
 		}
+		buffer->capacity = capacity;
+		pool->used = buffer->offset + capacity;
+		create_buffer(pool, buffer, width, height);
+	} else if (buffer->width != width || buffer->height != height) {
+		create_buffer(pool, buffer, width, height);
+	} else {
+		buffer->fresh = false;
 	}
 	buffer->busy = true;
 	return buffer;
@@ -1,10 +1,17 @@
 #ifndef SHM_H
 #define SHM_H
 #include <cairo/cairo.h>
-#include <pango/pangocairo.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+#define WSK_MAX_BUFFERS 4
+
+/* A pool more than SHM_SHRINK_RATIO times too large is re-created after
+ * SHM_SHRINK_DELAY seconds */
+#define SHM_SHRINK_RATIO 4
+#define SHM_SHRINK_DELAY 5
 
 int create_shm_file(void);
 int allocate_shm_file(size_t size);
@@ -13,15 +20,43 @@ struct pool_buffer {
 	struct wl_buffer *buffer;
 	cairo_surface_t *surface;
 	cairo_t *cairo;
-	PangoContext *pango;
 	uint32_t width, height;
 	void *data;
-	size_t size;
+	/* Region of the shm_pool this buffer occupies */
+	size_t offset, capacity;
 	bool busy;
+	/* Set when the contents were lost by the last get_next_buffer call */
+	bool fresh;
+};
+
+/*
+ * One wl_shm_pool backing all of a surface's buffers. Buffers are
+ * suballocated from it as offsets, and it grows in place as needed.
+ */
+struct shm_pool {
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	void *data;
+	size_t size, used;
+	struct timespec oversized_since;
+	struct pool_buffer buffers[WSK_MAX_BUFFERS];
+	size_t depth;
 };
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+void shm_pool_init(struct shm_pool *pool, struct wl_shm *shm, size_t depth);
+void shm_pool_finish(struct shm_pool *pool);
+struct pool_buffer *get_next_buffer(struct shm_pool *pool,
+		uint32_t width, uint32_t height);
 void destroy_buffer(struct pool_buffer *buffer);
 
+/*
+ * A buffer with its own mapping rather than a region of a shm_pool, for
+ * contents drawn once and then only attached, like the keys of -S. Its
+ * capacity is the size of the mapping.
+ */
+bool create_single_buffer(struct pool_buffer *buffer, struct wl_shm *shm,
+		uint32_t width, uint32_t height);
+void destroy_single_buffer(struct pool_buffer *buffer);
+
 #endif
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "render.h"
+#include "shm.h"
+#include "worker.h"
+
+static void run_job(struct wsk_worker *worker, struct wsk_render_job *job) {
+	// Pick up buffers the compositor has let go of since the last job
+	wl_display_dispatch_queue_pending(worker->display, worker->queue);
+	if (job->unused) {
+		job->unused->busy = false;
+		job->unused = NULL;
+	}
+	if (job->changed_seq != UINT64_MAX) {
+		render_key_changed(job->renderer, job->changed_seq);
+	}
+
+	job->buffer = NULL;
+	render_plan(job->renderer, &job->keys, &job->frame);
+	uint32_t width = job->frame.width, height = job->frame.height;
+	if (width == 0 || height == 0) {
+		render_invalidate(job->renderer);
+		job->animating = false;
+		return;
+	}
+	job->buffer = get_next_buffer(job->pool, width, height);
+	if (job->buffer) {
+		render_draw(job->renderer, &job->keys, &job->frame, job->buffer);
+	}
+	job->animating = job->renderer->animating;
+}
+
+static void *worker_run(void *data) {
+	struct wsk_worker *worker = data;
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		while (!worker->todo && !worker->quit) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		if (worker->quit) {
+			break;
+		}
+		struct wsk_render_job *job = worker->todo;
+		worker->todo = job->next;
+		worker->running_job = job;
+		pthread_mutex_unlock(&worker->lock);
+
+		pthread_mutex_lock(&worker->render_lock);
+		run_job(worker, job);
+		pthread_mutex_unlock(&worker->render_lock);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->running_job = NULL;
+		job->next = worker->done;
+		worker->done = job;
+		pthread_cond_broadcast(&worker->cond);
+		uint64_t one = 1;
+		if (write(worker->done_fd, &one, sizeof(one)) < 0) {
+			fprintf(stderr, "eventfd write: %s\n", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+/* Cleans up after itself if it fails */
+bool worker_start(struct wsk_worker *worker,
+		struct wl_display *display, struct wl_shm *shm) {
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_mutex_init(&worker->render_lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	worker->display = display;
+	worker->queue = wl_display_create_queue(display);
+	worker->shm = wl_proxy_create_wrapper(shm);
+	worker->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (!worker->queue || !worker->shm || worker->done_fd < 0) {
+		fprintf(stderr, "Unable to set up the render worker\n");
+		worker_finish(worker);
+		return false;
+	}
+	wl_proxy_set_queue((struct wl_proxy *)worker->shm, worker->queue);
+
+	// Signals are left to the main thread's signalfd
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&worker->thread, NULL, worker_run, worker);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		worker_finish(worker);
+		return false;
+	}
+	worker->running = true;
+	return true;
+}
+
+void worker_submit(struct wsk_worker *worker, struct wsk_render_job *job) {
+	pthread_mutex_lock(&worker->lock);
+	job->queued = true;
+	job->next = NULL;
+	struct wsk_render_job **link = &worker->todo;
+	while (*link) {
+		link = &(*link)->next;
+	}
+	*link = job;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Returns a finished job, or NULL once there are no more */
+struct wsk_render_job *worker_collect(struct wsk_worker *worker) {
+	pthread_mutex_lock(&worker->lock);
+	struct wsk_render_job *job = worker->done;
+	if (job) {
+		worker->done = job->next;
+		job->queued = false;
+	} else {
+		uint64_t count;
+		if (read(worker->done_fd, &count, sizeof(count)) < 0
+				&& errno != EAGAIN) {
+			fprintf(stderr, "eventfd read: %s\n", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return job;
+}
+
+static bool unlink_job(struct wsk_render_job **link,
+		struct wsk_render_job *job) {
+	for (; *link; link = &(*link)->next) {
+		if (*link == job) {
+			*link = job->next;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Takes job back, waiting for it if it is being drawn */
+void worker_cancel(struct wsk_worker *worker, struct wsk_render_job *job) {
+	if (!job->queued) {
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	while (worker->running_job == job) {
+		pthread_cond_wait(&worker->cond, &worker->lock);
+	}
+	if (!unlink_job(&worker->todo, job)) {
+		unlink_job(&worker->done, job);
+	}
+	job->queued = false;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void worker_lock(struct wsk_worker *worker) {
+	pthread_mutex_lock(&worker->render_lock);
+}
+
+void worker_unlock(struct wsk_worker *worker) {
+	pthread_mutex_unlock(&worker->render_lock);
+}
+
+int worker_get_fd(struct wsk_worker *worker) {
+	return worker->done_fd;
+}
+
+void worker_finish(struct wsk_worker *worker) {
+	if (worker->running) {
+		pthread_mutex_lock(&worker->lock);
+		worker->quit = true;
+		pthread_cond_broadcast(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+		worker->running = false;
+	}
+	if (worker->shm) {
+		wl_proxy_wrapper_destroy(worker->shm);
+	}
+	if (worker->queue) {
+		wl_event_queue_destroy(worker->queue);
+	}
+	if (worker->done_fd >= 0) {
+		close(worker->done_fd);
+	}
+	pthread_mutex_destroy(&worker->render_lock);
+	pthread_mutex_destroy(&worker->lock);
+	pthread_cond_destroy(&worker->cond);
+	memset(worker, 0, sizeof(struct wsk_worker));
+	worker->done_fd = -1;
+}
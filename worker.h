@@ -0,0 +1,68 @@
+#ifndef _WSK_WORKER_H
+#define _WSK_WORKER_H
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "render.h"
+#include "shm.h"
+
+/*
+ * A frame to plan and draw off the main thread. The renderer and pool are
+ * only touched by the worker while the job is in flight.
+ */
+struct wsk_render_job {
+	/* Filled in by the main thread */
+	struct wsk_renderer *renderer;
+	struct shm_pool *pool;
+	struct wsk_keys keys; // A copy, so the main thread can go on typing
+	uint64_t changed_seq; // Passed to render_key_changed, or UINT64_MAX
+	/* A buffer from an earlier job which was never attached */
+	struct pool_buffer *unused;
+	struct wsk_frame frame; // scale and time, the rest is filled in
+	void *data;
+
+	/* Filled in by the worker: buffer is NULL if the keys need no room or
+	 * no buffer was free */
+	struct pool_buffer *buffer;
+	bool animating;
+
+	bool queued; // Until it has been collected
+	struct wsk_render_job *next;
+};
+
+/*
+ * Runs render jobs on a thread, one at a time, and signals done_fd as they
+ * finish. Buffer releases for the pools it draws into are dispatched there
+ * too, from a queue of its own, so that the worker alone decides which
+ * buffers are free.
+ *
+ * The render lock is held while a job runs. The main thread takes it before
+ * touching a pool or the label cache outside of a job.
+ */
+struct wsk_worker {
+	pthread_t thread;
+	bool running, quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wsk_render_job *todo, *running_job, *done;
+
+	pthread_mutex_t render_lock;
+	struct wl_display *display;
+	struct wl_event_queue *queue;
+	/* wl_shm, with new pools and buffers going to queue */
+	struct wl_shm *shm;
+	int done_fd;
+};
+
+bool worker_start(struct wsk_worker *worker,
+		struct wl_display *display, struct wl_shm *shm);
+void worker_submit(struct wsk_worker *worker, struct wsk_render_job *job);
+struct wsk_render_job *worker_collect(struct wsk_worker *worker);
+void worker_cancel(struct wsk_worker *worker, struct wsk_render_job *job);
+void worker_lock(struct wsk_worker *worker);
+void worker_unlock(struct wsk_worker *worker);
+int worker_get_fd(struct wsk_worker *worker);
+void worker_finish(struct wsk_worker *worker);
+
+#endif